@@ -0,0 +1,430 @@
+/************************************************************************
+ * backend-xcb.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/record.h>
+#include <xcb/xtest.h>
+#include <xcb/xkb.h>
+
+#include "xcape.h"
+
+
+/* Size of one recorded device event */
+#define EVENT_SIZE 32
+
+/* Categories of intercepted data from the RECORD protocol spec, which
+ * xcb/record.h does not name */
+#define RECORD_FROM_SERVER 0
+#define RECORD_START_OF_DATA 4
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+struct _Backend_t
+{
+    xcb_connection_t *data_conn;
+    xcb_connection_t *ctrl_conn;
+    xcb_record_context_t record_ctx;
+    xcb_record_enable_context_cookie_t enable_cookie;
+    uint8_t xkb_event;
+};
+
+/* The XKB events xcape selects, all sharing one response type */
+typedef union _XkbEvent_t
+{
+    struct
+    {
+        uint8_t response_type;
+        uint8_t xkbType;
+    } any;
+    xcb_xkb_new_keyboard_notify_event_t new_keyboard;
+    xcb_xkb_map_notify_event_t map;
+    xcb_xkb_state_notify_event_t state;
+} XkbEvent_t;
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void refresh_keymap (Session_t *self, int first, int count);
+
+xcb_xkb_get_map_cookie_t request_keymap (xcb_connection_t *conn,
+        int first, int count);
+
+Bool copy_keys (Keymap_t *keymap, xcb_xkb_get_map_reply_t *reply);
+
+/************************************************************************
+ * Backend interface
+ ***********************************************************************/
+Bool backend_open (Session_t *self)
+{
+    Backend_t *b = calloc (1, sizeof (Backend_t));
+    const xcb_query_extension_reply_t *ext;
+    xcb_xkb_use_extension_cookie_t use_cookie;
+    xcb_xkb_use_extension_reply_t *use_reply;
+    xcb_record_query_version_cookie_t record_cookie;
+    xcb_record_query_version_reply_t *record_reply;
+    xcb_xkb_get_map_cookie_t map_cookie;
+    xcb_xkb_get_map_reply_t *map_reply;
+    xcb_xkb_get_state_cookie_t state_cookie;
+    xcb_xkb_get_state_reply_t *state_reply;
+    uint16_t events = XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY
+        | XCB_XKB_EVENT_TYPE_MAP_NOTIFY
+        | XCB_XKB_EVENT_TYPE_STATE_NOTIFY;
+
+    self->backend = b;
+
+    if (self->xcape->devices != NULL)
+    {
+        fprintf (stderr, "--devices needs xcape built with BACKEND=xi2\n");
+        return False;
+    }
+
+    b->data_conn = xcb_connect (self->display, NULL);
+    b->ctrl_conn = xcb_connect (self->display, NULL);
+
+    if (xcb_connection_has_error (b->data_conn)
+            || xcb_connection_has_error (b->ctrl_conn))
+    {
+        if (self->display != NULL)
+            fprintf (stderr, "Unable to connect to X11 display %s\n",
+                    self->display);
+        else
+            fprintf (stderr, "Unable to connect to X11 display. "
+                    "Is $DISPLAY set?\n");
+        return False;
+    }
+    startup_mark (self, STARTUP_CONNECT);
+
+    /* Send every startup request before waiting for the first reply */
+    xcb_prefetch_extension_data (b->ctrl_conn, &xcb_test_id);
+    xcb_prefetch_extension_data (b->ctrl_conn, &xcb_record_id);
+    xcb_prefetch_extension_data (b->ctrl_conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data (b->data_conn, &xcb_record_id);
+
+    ext = xcb_get_extension_data (b->ctrl_conn, &xcb_test_id);
+    if (ext == NULL || !ext->present)
+    {
+        fprintf (stderr, "Xtst extension missing\n");
+        return False;
+    }
+
+    ext = xcb_get_extension_data (b->ctrl_conn, &xcb_xkb_id);
+    if (ext == NULL || !ext->present)
+    {
+        fprintf (stderr, "Failed to obtain xkb version\n");
+        return False;
+    }
+    b->xkb_event = ext->first_event;
+
+    use_cookie = xcb_xkb_use_extension (b->ctrl_conn,
+            XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION);
+    record_cookie = xcb_record_query_version (b->ctrl_conn,
+            XCB_RECORD_MAJOR_VERSION, XCB_RECORD_MINOR_VERSION);
+    xcb_xkb_select_events (b->ctrl_conn, XCB_XKB_ID_USE_CORE_KBD,
+            events, 0, events, 0, 0, NULL);
+    map_cookie = request_keymap (b->ctrl_conn, 0, 0);
+    state_cookie = xcb_xkb_get_state (b->ctrl_conn, XCB_XKB_ID_USE_CORE_KBD);
+
+    use_reply = xcb_xkb_use_extension_reply (b->ctrl_conn, use_cookie, NULL);
+    if (use_reply == NULL || !use_reply->supported)
+    {
+        fprintf (stderr, "Failed to obtain xkb version\n");
+        return False;
+    }
+    free (use_reply);
+
+    record_reply = xcb_record_query_version_reply (b->ctrl_conn,
+            record_cookie, NULL);
+    if (record_reply == NULL)
+    {
+        fprintf (stderr, "Failed to obtain xrecord version\n");
+        return False;
+    }
+    free (record_reply);
+    startup_mark (self, STARTUP_EXTENSIONS);
+
+    map_reply = xcb_xkb_get_map_reply (b->ctrl_conn, map_cookie, NULL);
+    if (map_reply == NULL || !copy_keys (&self->engine.keymap, map_reply))
+    {
+        fprintf (stderr, "Failed to get keyboard mapping\n");
+        return False;
+    }
+    free (map_reply);
+
+    state_reply = xcb_xkb_get_state_reply (b->ctrl_conn, state_cookie, NULL);
+    if (state_reply == NULL)
+    {
+        fprintf (stderr, "Failed to get keyboard state\n");
+        return False;
+    }
+    self->engine.intended_group = state_reply->lockedGroup;
+    free (state_reply);
+    startup_mark (self, STARTUP_KEYMAP);
+
+    self->data_fd = xcb_get_file_descriptor (b->data_conn);
+    self->ctrl_fd = xcb_get_file_descriptor (b->ctrl_conn);
+
+    return True;
+}
+
+Bool backend_start (Session_t *self)
+{
+    Backend_t *b = self->backend;
+    xcb_record_client_spec_t client_spec = XCB_RECORD_CS_ALL_CLIENTS;
+    xcb_record_range_t range;
+
+    memset (&range, 0, sizeof (range));
+    range.device_events.first = XCB_KEY_PRESS;
+    range.device_events.last = XCB_BUTTON_RELEASE;
+
+    /* Created on the connection that enables it, the server takes both
+     * in order and no round trip is needed in between. If creating
+     * fails, so does enabling, see backend_process_data (). */
+    b->record_ctx = xcb_generate_id (b->data_conn);
+    xcb_record_create_context (b->data_conn, b->record_ctx, 0, 1, 1,
+            &client_spec, &range);
+
+    b->enable_cookie = xcb_record_enable_context (b->data_conn,
+            b->record_ctx);
+    if (xcb_flush (b->data_conn) <= 0)
+    {
+        fprintf (stderr, "Failed to enable xrecord context\n");
+        return False;
+    }
+
+    return True;
+}
+
+void backend_stop (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    /* Nothing to tell a server that is gone */
+    if (self->lost)
+    {
+        backend_close (self);
+        return;
+    }
+
+    xcb_record_disable_context (b->ctrl_conn, b->record_ctx);
+    xcb_record_free_context (b->ctrl_conn, b->record_ctx);
+    xcb_flush (b->ctrl_conn);
+
+    backend_close (self);
+}
+
+/* Also after a failed backend_open () or with the connection lost */
+void backend_close (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    if (b == NULL)
+        return;
+
+    /* Even a connection that failed must be disconnected */
+    if (b->ctrl_conn != NULL)
+        xcb_disconnect (b->ctrl_conn);
+    if (b->data_conn != NULL)
+        xcb_disconnect (b->data_conn);
+
+    free (b);
+    self->backend = NULL;
+}
+
+/* Hand every recorded event already received to handle_event() */
+void backend_process_data (Session_t *self)
+{
+    Backend_t *b = self->backend;
+    xcb_record_enable_context_reply_t *reply;
+    xcb_generic_error_t *error = NULL;
+    uint8_t *data;
+    int len, i;
+
+    while (xcb_poll_for_reply (b->data_conn, b->enable_cookie.sequence,
+                (void **)&reply, &error) && reply != NULL)
+    {
+        if (reply->category == RECORD_START_OF_DATA)
+            startup_mark (self, STARTUP_READY);
+
+        if (reply->category == RECORD_FROM_SERVER)
+        {
+            data = xcb_record_enable_context_data (reply);
+            len = xcb_record_enable_context_data_length (reply);
+
+            /* One reply carries as many events as the server buffered */
+            for (i = 0; i + EVENT_SIZE <= len; i += EVENT_SIZE)
+            {
+                xcb_key_press_event_t *ev = (xcb_key_press_event_t *)(data + i);
+
+                handle_event (self, ev->response_type & 0x7f,
+                        ev->detail, ev->time);
+            }
+        }
+        free (reply);
+    }
+
+    if (error != NULL)
+    {
+        fprintf (stderr, "Error %d on the xrecord context\n",
+                error->error_code);
+        free (error);
+    }
+
+    if (xcb_connection_has_error (b->data_conn))
+        self->lost = True;
+}
+
+void backend_process_ctrl (Session_t *self)
+{
+    Backend_t *b = self->backend;
+    xcb_generic_event_t *ev;
+
+    while ((ev = xcb_poll_for_event (b->ctrl_conn)) != NULL)
+    {
+        XkbEvent_t *xkb_ev = (XkbEvent_t *)ev;
+
+        if ((ev->response_type & 0x7f) == XCB_MAPPING_NOTIFY)
+        {
+            xcb_mapping_notify_event_t *mn = (xcb_mapping_notify_event_t *)ev;
+
+            if (mn->request == XCB_MAPPING_KEYBOARD)
+                refresh_keymap (self, mn->first_keycode, mn->count);
+        }
+        else if ((ev->response_type & 0x7f) == b->xkb_event
+                && xkb_ev->any.xkbType == XCB_XKB_MAP_NOTIFY
+                && (xkb_ev->map.changed & XCB_XKB_MAP_PART_KEY_SYMS))
+        {
+            refresh_keymap (self, xkb_ev->map.firstKeySym,
+                    xkb_ev->map.nKeySyms);
+        }
+        else if ((ev->response_type & 0x7f) == b->xkb_event
+                && xkb_ev->any.xkbType == XCB_XKB_NEW_KEYBOARD_NOTIFY)
+        {
+            refresh_keymap (self, 0, 0);
+        }
+        else if ((ev->response_type & 0x7f) == b->xkb_event
+                && xkb_ev->any.xkbType == XCB_XKB_STATE_NOTIFY
+                && (xkb_ev->state.changed & XCB_XKB_STATE_PART_GROUP_LOCK))
+        {
+            handle_group_change (self, xkb_ev->state.lockedGroup,
+                    xkb_ev->state.keycode, xkb_ev->state.time);
+        }
+        free (ev);
+    }
+
+    if (xcb_connection_has_error (b->ctrl_conn))
+        self->lost = True;
+}
+
+void backend_fake_key (Session_t *self, KeyCode key, Bool press)
+{
+    xcb_test_fake_input (self->backend->ctrl_conn,
+            press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, key,
+            XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+void backend_lock_group (Session_t *self, int group)
+{
+    xcb_xkb_latch_lock_state (self->backend->ctrl_conn,
+            XCB_XKB_ID_USE_CORE_KBD, 0, 0, 1, group, 0, 0, 0);
+}
+
+void backend_flush (Session_t *self)
+{
+    xcb_flush (self->backend->ctrl_conn);
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+
+/* Re-fetch count key codes from first, or the whole map if count is 0 */
+void refresh_keymap (Session_t *self, int first, int count)
+{
+    Backend_t *b = self->backend;
+    xcb_xkb_get_map_reply_t *reply;
+
+    reply = xcb_xkb_get_map_reply (b->ctrl_conn,
+            request_keymap (b->ctrl_conn, first, count), NULL);
+    if (reply == NULL || !copy_keys (&self->engine.keymap, reply))
+    {
+        fprintf (stderr, "Failed to update keyboard mapping\n");
+        free (reply);
+        return;
+    }
+
+    first = reply->firstKeySym;
+    count = reply->nKeySyms;
+    free (reply);
+
+    keymap_changed (self, first, count);
+}
+
+xcb_xkb_get_map_cookie_t request_keymap (xcb_connection_t *conn,
+        int first, int count)
+{
+    return xcb_xkb_get_map (conn, XCB_XKB_ID_USE_CORE_KBD,
+            count == 0 ? XCB_XKB_MAP_PART_KEY_SYMS : 0,
+            count == 0 ? 0 : XCB_XKB_MAP_PART_KEY_SYMS,
+            0, 0, first, count, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+Bool copy_keys (Keymap_t *keymap, xcb_xkb_get_map_reply_t *reply)
+{
+    xcb_xkb_get_map_map_t map;
+    xcb_xkb_key_sym_map_iterator_t it;
+    xcb_keysym_t *syms;
+    int kc, group, level;
+
+    if (xcb_xkb_get_map_map_unpack (xcb_xkb_get_map_map (reply),
+                reply->nTypes, reply->nKeySyms, reply->nKeyActions,
+                reply->totalActions, reply->totalKeyBehaviors,
+                reply->virtualMods, reply->totalKeyExplicit,
+                reply->totalModMapKeys, reply->totalVModMapKeys,
+                reply->present, &map) < 0)
+        return False;
+
+    keymap->min_key_code = reply->minKeyCode;
+    keymap->max_key_code = reply->maxKeyCode;
+
+    it = xcb_xkb_get_map_map_syms_rtrn_iterator (reply, &map);
+    for (kc = reply->firstKeySym; it.rem > 0;
+            kc++, xcb_xkb_key_sym_map_next (&it))
+    {
+        int groups = it.data->groupInfo & 0x0f;
+        int width = it.data->width;
+
+        syms = xcb_xkb_key_sym_map_syms (it.data);
+
+        keymap->groups[kc] = groups < KEYMAP_GROUPS ? groups : KEYMAP_GROUPS;
+        keymap->width[kc] = width < KEYMAP_LEVELS ? width : KEYMAP_LEVELS;
+        for (group = 0; group < keymap->groups[kc]; group++)
+        {
+            for (level = 0; level < keymap->width[kc]; level++)
+                keymap->syms[kc][group][level] = syms[group * width + level];
+        }
+    }
+
+    return True;
+}
@@ -0,0 +1,304 @@
+/************************************************************************
+ * backend-xi2.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Key events as XInput2 raw events instead of XRecord, 'make
+ * BACKEND=xi2'. Raw events are selected per device, so with --devices
+ * the server only sends key events of the listed keyboards, and of the
+ * XTEST keyboard that echoes what xcape generates. Buttons are taken
+ * from every pointer. Generating keys and following the keymap are
+ * shared with backend-xlib.c, see xlib-ctrl.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+
+#include "xcape.h"
+#include "xlib-ctrl.h"
+
+/* Raw events reach clients during grabs since XI 2.1 */
+#define XI2_MAJOR 2
+#define XI2_MINOR 2
+
+/* Most keyboards selected by --devices, besides the XTEST keyboards */
+#define XI2_DEVICES 32
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+struct _Backend_t
+{
+    Display *data_conn;
+    XlibCtrl_t ctrl;
+    int xi_opcode;
+};
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+Bool select_devices (Session_t *self, Bool required);
+
+Bool device_listed (const char *list, const XIDeviceInfo *info);
+
+void intercept (Session_t *self, XGenericEventCookie *cookie);
+
+/************************************************************************
+ * Backend interface
+ ***********************************************************************/
+Bool backend_open (Session_t *self)
+{
+    Backend_t *b = calloc (1, sizeof (Backend_t));
+    int major = XI2_MAJOR, minor = XI2_MINOR;
+
+    self->backend = b;
+
+    if (!xlib_ctrl_connect (self, &b->ctrl, &b->data_conn,
+                &xlib_ext_xinput))
+        return False;
+
+    if (!xlib_ctrl_query (&b->ctrl))
+        return False;
+    if (!xlib_extension (b->data_conn, &xlib_ext_xinput, &b->xi_opcode)
+            || XIQueryVersion (b->data_conn, &major, &minor) != Success
+            || major * 100 + minor < XI2_MAJOR * 100 + 1)
+    {
+        fprintf (stderr, "Failed to obtain XInput 2.1 or later\n");
+        return False;
+    }
+    startup_mark (self, STARTUP_EXTENSIONS);
+
+    if (!xlib_ctrl_keymap (self, &b->ctrl))
+        return False;
+
+    self->data_fd = ConnectionNumber (b->data_conn);
+
+    return True;
+}
+
+Bool backend_start (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    if (!select_devices (self, True))
+        return False;
+
+    /* Selected once the server has replied to anything after it */
+    XSync (b->data_conn, False);
+    startup_mark (self, STARTUP_READY);
+
+    return True;
+}
+
+/* Selections end with the connection, there is no context to free */
+void backend_stop (Session_t *self)
+{
+    backend_close (self);
+}
+
+/* Also after a failed backend_open () or with the connection lost */
+void backend_close (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    if (b == NULL)
+        return;
+
+    xlib_ctrl_close (&b->ctrl);
+    if (b->data_conn != NULL)
+        XCloseDisplay (b->data_conn);
+
+    free (b);
+    self->backend = NULL;
+}
+
+void backend_process_data (Session_t *self)
+{
+    Backend_t *b = self->backend;
+    XEvent ev;
+
+    while (XEventsQueued (b->data_conn, QueuedAfterReading) > 0)
+    {
+        XNextEvent (b->data_conn, &ev);
+
+        if (ev.xcookie.type != GenericEvent
+                || ev.xcookie.extension != b->xi_opcode
+                || !XGetEventData (b->data_conn, &ev.xcookie))
+            continue;
+
+        intercept (self, &ev.xcookie);
+        XFreeEventData (b->data_conn, &ev.xcookie);
+    }
+}
+
+XlibCtrl_t *xlib_ctrl (Session_t *self)
+{
+    return &self->backend->ctrl;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/*
+ * Raw key events of the keyboards in --devices and the XTEST keyboards,
+ * or of all keyboards without it, and raw buttons of all pointers.
+ * Keys are selected on slave devices or on the masters, never both, so
+ * no event arrives twice. Called again when devices come and go. If
+ * none of --devices is there, fails if required, else only warns.
+ */
+Bool select_devices (Session_t *self, Bool required)
+{
+    Backend_t *b = self->backend;
+    unsigned char keys[XIMaskLen (XI_LASTEVENT)];
+    unsigned char all[XIMaskLen (XI_LASTEVENT)];
+    unsigned char hierarchy[XIMaskLen (XI_LASTEVENT)];
+    XIEventMask em[XI2_DEVICES + 2];
+    XIDeviceInfo *info;
+    int i, n_info, n = 0, listed = 0;
+
+    memset (keys, 0, sizeof (keys));
+    XISetMask (keys, XI_RawKeyPress);
+    XISetMask (keys, XI_RawKeyRelease);
+
+    memset (all, 0, sizeof (all));
+    XISetMask (all, XI_RawButtonPress);
+    XISetMask (all, XI_RawButtonRelease);
+    if (self->xcape->devices == NULL)
+    {
+        XISetMask (all, XI_RawKeyPress);
+        XISetMask (all, XI_RawKeyRelease);
+    }
+    em[n].deviceid = XIAllMasterDevices;
+    em[n].mask_len = sizeof (all);
+    em[n++].mask = all;
+
+    if (self->xcape->devices != NULL)
+    {
+        info = XIQueryDevice (b->data_conn, XIAllDevices, &n_info);
+        if (info == NULL)
+        {
+            fprintf (stderr, "Failed to query XInput devices\n");
+            return False;
+        }
+        for (i = 0; i < n_info; i++)
+        {
+            if (info[i].use != XISlaveKeyboard
+                    && info[i].use != XIFloatingSlave)
+                continue;
+            if (strstr (info[i].name, "XTEST") == NULL)
+            {
+                if (!device_listed (self->xcape->devices, &info[i]))
+                    continue;
+                listed++;
+            }
+
+            if (n == XI2_DEVICES + 1)
+            {
+                fprintf (stderr, "WARNING: Only the first %d keyboards "
+                        "are used\n", XI2_DEVICES);
+                break;
+            }
+            if (self->debug) fprintf (stderr, "Using keyboard %d, %s\n",
+                    info[i].deviceid, info[i].name);
+            em[n].deviceid = info[i].deviceid;
+            em[n].mask_len = sizeof (keys);
+            em[n++].mask = keys;
+        }
+        XIFreeDeviceInfo (info);
+
+        if (listed == 0 && required)
+        {
+            fprintf (stderr, "No keyboard in --devices found: %s\n",
+                    self->xcape->devices);
+            return False;
+        }
+        if (listed == 0)
+            fprintf (stderr, "WARNING: No keyboard in --devices found: %s\n",
+                    self->xcape->devices);
+    }
+
+    /* To select keyboards plugged in later */
+    memset (hierarchy, 0, sizeof (hierarchy));
+    XISetMask (hierarchy, XI_HierarchyChanged);
+    em[n].deviceid = XIAllDevices;
+    em[n].mask_len = sizeof (hierarchy);
+    em[n++].mask = hierarchy;
+
+    if (XISelectEvents (b->data_conn, DefaultRootWindow (b->data_conn),
+                em, n) != Success)
+    {
+        fprintf (stderr, "Failed to select XInput events\n");
+        return False;
+    }
+
+    return True;
+}
+
+/* A comma separated list of device names and ids */
+Bool device_listed (const char *list, const XIDeviceInfo *info)
+{
+    const char *c = list, *end;
+    char id[16];
+    size_t len;
+
+    snprintf (id, sizeof (id), "%d", info->deviceid);
+    for (;;)
+    {
+        end = strchr (c, ',');
+        len = end != NULL ? (size_t)(end - c) : strlen (c);
+
+        if ((len == strlen (info->name)
+                    && strncmp (c, info->name, len) == 0)
+                || (len == strlen (id) && strncmp (c, id, len) == 0))
+            return True;
+
+        if (end == NULL)
+            return False;
+        c = end + 1;
+    }
+}
+
+void intercept (Session_t *self, XGenericEventCookie *cookie)
+{
+    XIRawEvent *raw = (XIRawEvent *)cookie->data;
+
+    switch (cookie->evtype)
+    {
+    case XI_RawKeyPress:
+        handle_event (self, KeyPress, raw->detail, raw->time);
+        break;
+    case XI_RawKeyRelease:
+        handle_event (self, KeyRelease, raw->detail, raw->time);
+        break;
+    case XI_RawButtonPress:
+        handle_event (self, ButtonPress, raw->detail, raw->time);
+        break;
+    case XI_RawButtonRelease:
+        handle_event (self, ButtonRelease, raw->detail, raw->time);
+        break;
+    case XI_HierarchyChanged:
+        if (((XIHierarchyEvent *)cookie->data)->flags
+                & (XISlaveAdded | XIDeviceEnabled))
+            select_devices (self, False);
+        break;
+    }
+}
@@ -0,0 +1,193 @@
+/************************************************************************
+ * backend-xlib.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/extensions/record.h>
+
+#include "xcape.h"
+#include "xlib-ctrl.h"
+
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+struct _Backend_t
+{
+    Display *data_conn;
+    XlibCtrl_t ctrl;
+    XRecordContext record_ctx;
+    XRecordRange *rec_range;
+};
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void intercept (XPointer user_data, XRecordInterceptData *data);
+
+/************************************************************************
+ * Backend interface
+ ***********************************************************************/
+Bool backend_open (Session_t *self)
+{
+    Backend_t *b = calloc (1, sizeof (Backend_t));
+    int dummy;
+
+    self->backend = b;
+
+    if (self->xcape->devices != NULL)
+    {
+        fprintf (stderr, "--devices needs xcape built with BACKEND=xi2\n");
+        return False;
+    }
+
+    if (!xlib_ctrl_connect (self, &b->ctrl, &b->data_conn,
+                &xlib_ext_record))
+        return False;
+
+    if (!xlib_ctrl_query (&b->ctrl))
+        return False;
+    /* libXtst asks again as backend_start () creates the context */
+    if (!xlib_extension (b->data_conn, &xlib_ext_record, &dummy))
+    {
+        fprintf (stderr, "Xrecord extension missing\n");
+        return False;
+    }
+    startup_mark (self, STARTUP_EXTENSIONS);
+
+    if (!xlib_ctrl_keymap (self, &b->ctrl))
+        return False;
+
+    self->data_fd = ConnectionNumber (b->data_conn);
+
+    return True;
+}
+
+Bool backend_start (Session_t *self)
+{
+    Backend_t *b = self->backend;
+    XRecordClientSpec client_spec = XRecordAllClients;
+
+    b->rec_range = XRecordAllocRange ();
+    b->rec_range->device_events.first = KeyPress;
+    b->rec_range->device_events.last = ButtonRelease;
+
+    /* Created on the connection that enables it, the server takes both
+     * in order and no round trip is needed in between */
+    b->record_ctx = XRecordCreateContext (b->data_conn,
+            0, &client_spec, 1, &b->rec_range, 1);
+
+    if (b->record_ctx == 0)
+    {
+        fprintf (stderr, "Failed to create xrecord context\n");
+        return False;
+    }
+
+    if (!XRecordEnableContextAsync (b->data_conn,
+                b->record_ctx, intercept, (XPointer)self))
+    {
+        fprintf (stderr, "Failed to enable xrecord context\n");
+        return False;
+    }
+    XFlush (b->data_conn);
+
+    return True;
+}
+
+void backend_stop (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    /* Nothing to tell a server that is gone */
+    if (self->lost)
+    {
+        backend_close (self);
+        return;
+    }
+
+    if (!XRecordDisableContext (b->ctrl.conn, b->record_ctx))
+    {
+        fprintf (stderr, "Failed to disable xrecord context\n");
+    }
+    XSync (b->ctrl.conn, False);
+
+    if (!XRecordFreeContext (b->ctrl.conn, b->record_ctx))
+    {
+        fprintf (stderr, "Failed to free xrecord context\n");
+    }
+
+    backend_close (self);
+}
+
+/* Also after a failed backend_open () or with the connection lost */
+void backend_close (Session_t *self)
+{
+    Backend_t *b = self->backend;
+
+    if (b == NULL)
+        return;
+
+    if (b->rec_range != NULL)
+        XFree (b->rec_range);
+
+    xlib_ctrl_close (&b->ctrl);
+    if (b->data_conn != NULL)
+        XCloseDisplay (b->data_conn);
+
+    free (b);
+    self->backend = NULL;
+}
+
+void backend_process_data (Session_t *self)
+{
+    XRecordProcessReplies (self->backend->data_conn);
+}
+
+XlibCtrl_t *xlib_ctrl (Session_t *self)
+{
+    return &self->backend->ctrl;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void intercept (XPointer user_data, XRecordInterceptData *data)
+{
+    Session_t *self = (Session_t *)user_data;
+
+    /* The event's own time, as the other backends use: server_time is
+     * that of the whole reply, as the context asks for no per-event
+     * times, and a reply may carry several events */
+    if (data->category == XRecordFromServer)
+    {
+        xEvent *ev = (xEvent *)data->data;
+
+        handle_event (self, ev->u.u.type, ev->u.u.detail,
+                ev->u.keyButtonPointer.time);
+    }
+    else if (data->category == XRecordStartOfData)
+    {
+        startup_mark (self, STARTUP_READY);
+    }
+
+    XRecordFreeData (data);
+}
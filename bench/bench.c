@@ -0,0 +1,508 @@
+/************************************************************************
+ * bench.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Replays key event traces through the engine with a virtual server
+ * clock, no X server needed. Generated key events come back as echoes
+ * once more than 'backlog' of them are outstanding, the way a busy
+ * server delivers them late. Built and run by 'make bench'; 'make
+ * check' runs it with -c, which fails if handling an event allocated.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <X11/Xlib.h>
+
+#include "../engine.h"
+#include "../trace.h"
+
+/* Mapped keys start here, the keys they generate follow them, and
+ * plain typing uses the rest, so typing never matches a pending echo */
+#define FIRST_FROM 8
+#define MAX_MAPPINGS 200
+#define FIRST_TO (FIRST_FROM + MAX_MAPPINGS)
+#define N_TO 24
+#define FIRST_OTHER (FIRST_TO + N_TO)
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+typedef struct _Event_t
+{
+    int type;
+    KeyCode key;
+    Time time;
+    int decision;               /* as recorded, -1 if synthetic */
+} Event_t;
+
+typedef struct _Trace_t
+{
+    Event_t *events;
+    size_t n;
+} Trace_t;
+
+typedef struct _Result_t
+{
+    double events_per_sec;
+    uint64_t p50, p99, p999;    /* ns per event */
+    unsigned long load_allocs;
+    unsigned long replay_allocs;
+    unsigned long generated;
+    unsigned long expired;
+    unsigned long mismatched;   /* decisions differing from the recording */
+} Result_t;
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void make_keymap (Keymap_t *keymap);
+
+char *make_mapping (int n_mappings);
+
+void make_trace (Trace_t *trace, int n_mappings, size_t n_events);
+
+Bool read_trace (Trace_t *trace, const char *path);
+
+Bool read_trace_file (Trace_t *trace, const char *path);
+
+void replay (const Keymap_t *keymap, const char *mapping,
+        const Trace_t *trace, int backlog, Result_t *result);
+
+size_t run (Engine_t *engine, const Trace_t *trace, int backlog,
+        uint64_t *samples, Result_t *result);
+
+uint64_t now_ns (void);
+
+int compare_u64 (const void *a, const void *b);
+
+void print_usage (const char *program_name);
+
+/************************************************************************
+ * Allocation counting, see the --wrap flags in the Makefile
+ ***********************************************************************/
+static unsigned long allocs;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *ptr, size_t size);
+
+void *__wrap_malloc (size_t size)
+{
+    allocs++;
+    return __real_malloc (size);
+}
+
+void *__wrap_calloc (size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc (n, size);
+}
+
+void *__wrap_realloc (void *ptr, size_t size)
+{
+    allocs++;
+    return __real_realloc (ptr, size);
+}
+
+/************************************************************************
+ * Main function
+ ***********************************************************************/
+int main (int argc, char **argv)
+{
+    static const int mappings[] = { 1, 10, 50, 100, 200 };
+    static const int backlogs[] = { 0, 8, 64, 512 };
+    static Keymap_t keymap;
+    size_t n_events = 1000000;
+    const char *trace_file = NULL;
+    char *mapping = NULL;
+    Trace_t trace;
+    Result_t r;
+    Bool check = False;
+    unsigned long event_allocs = 0;
+    int ch, m, b;
+
+    while ((ch = getopt (argc, argv, "n:r:e:c")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            check = True;
+            break;
+        case 'n':
+            n_events = strtoul (optarg, NULL, 0);
+            break;
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 'e':
+            mapping = optarg;
+            break;
+        default:
+            print_usage (argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    make_keymap (&keymap);
+
+    fprintf (stdout, "%8s %8s %12s %8s %8s %8s %7s %7s %9s %8s\n",
+            "mappings", "backlog", "events/s", "p50 ns", "p99 ns",
+            "p999 ns", "loadmem", "evmem", "generated", "expired");
+
+    /* A recording already holds the echoes, so none are fed back */
+    if (trace_file != NULL)
+    {
+        if (!read_trace (&trace, trace_file))
+            return EXIT_FAILURE;
+        if (mapping == NULL)
+            mapping = make_mapping (MAX_MAPPINGS);
+
+        replay (&keymap, mapping, &trace, -1, &r);
+        fprintf (stdout, "%8s %8s %12.0f %8lu %8lu %8lu %7lu %7lu %9lu %8lu\n",
+                "trace", "-", r.events_per_sec,
+                (unsigned long)r.p50, (unsigned long)r.p99,
+                (unsigned long)r.p999, r.load_allocs, r.replay_allocs,
+                r.generated, r.expired);
+        fprintf (stdout, "%lu of %lu decisions differ from the recording\n",
+                r.mismatched, (unsigned long)trace.n);
+        event_allocs = r.replay_allocs;
+    }
+
+    for (m = 0; trace_file == NULL
+            && m < sizeof (mappings) / sizeof (mappings[0]); m++)
+    {
+        mapping = make_mapping (mappings[m]);
+        make_trace (&trace, mappings[m], n_events);
+
+        for (b = 0; b < sizeof (backlogs) / sizeof (backlogs[0]); b++)
+        {
+            replay (&keymap, mapping, &trace, backlogs[b], &r);
+            fprintf (stdout, "%8d %8d %12.0f %8lu %8lu %8lu %7lu %7lu %9lu %8lu\n",
+                    mappings[m], backlogs[b], r.events_per_sec,
+                    (unsigned long)r.p50, (unsigned long)r.p99,
+                    (unsigned long)r.p999, r.load_allocs, r.replay_allocs,
+                    r.generated, r.expired);
+            event_allocs += r.replay_allocs;
+        }
+
+        free (trace.events);
+        free (mapping);
+    }
+
+    /* The event path must not allocate, see engine_load () */
+    if (check && event_allocs > 0)
+    {
+        fprintf (stderr, "FAIL: %lu allocations while handling events\n",
+                event_allocs);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/* One distinct Unicode keysym per key code */
+void make_keymap (Keymap_t *keymap)
+{
+    int kc;
+
+    keymap->min_key_code = 8;
+    keymap->max_key_code = 255;
+    for (kc = keymap->min_key_code; kc <= keymap->max_key_code; kc++)
+    {
+        keymap->groups[kc] = 1;
+        keymap->width[kc] = 1;
+        keymap->syms[kc][0][0] = 0x1000100 + kc;
+    }
+}
+
+/* Mapping i turns key code FIRST_FROM + i into one or two generated keys */
+char *make_mapping (int n_mappings)
+{
+    char *mapping = malloc (n_mappings * 24 + 1);
+    char *c = mapping;
+    int i, to;
+
+    *c = '\0';
+    for (i = 0; i < n_mappings; i++)
+    {
+        to = FIRST_TO + i % N_TO;
+        c += sprintf (c, "%s#%d=#%d", i > 0 ? ";" : "", FIRST_FROM + i, to);
+        if (i % 4 == 3)
+            c += sprintf (c, "|#%d", FIRST_TO + (i + 1) % N_TO);
+    }
+
+    return mapping;
+}
+
+/*
+ * Mostly taps of mapped keys, with holds past the timeout, mapped keys
+ * used as modifiers, mouse clicks and plain typing mixed in.
+ */
+void make_trace (Trace_t *trace, int n_mappings, size_t n_events)
+{
+    uint32_t rnd = 2463534242u;
+    Time t = 1;
+    size_t n = 0;
+    Event_t *e;
+
+    trace->events = malloc ((n_events + 4) * sizeof (Event_t));
+
+#define RND() (rnd ^= rnd << 13, rnd ^= rnd >> 17, rnd ^= rnd << 5, rnd)
+#define PUSH(ty, kc, dt) \
+    (e = &trace->events[n++], t += (dt), e->type = (ty), \
+     e->key = (kc), e->time = t, e->decision = -1)
+
+    while (n < n_events)
+    {
+        KeyCode from = FIRST_FROM + RND () % n_mappings;
+        KeyCode other = FIRST_OTHER + RND () % (256 - FIRST_OTHER);
+        uint32_t kind = RND () % 100;
+
+        if (kind < 60)
+        {
+            PUSH (KeyPress, from, 1 + RND () % 50);
+            PUSH (KeyRelease, from, 20 + RND () % 200);
+        }
+        else if (kind < 70)
+        {
+            PUSH (KeyPress, from, 1 + RND () % 50);
+            PUSH (KeyRelease, from, 600 + RND () % 400);
+        }
+        else if (kind < 85)
+        {
+            PUSH (KeyPress, from, 1 + RND () % 50);
+            PUSH (KeyPress, other, 20 + RND () % 100);
+            PUSH (KeyRelease, other, 20 + RND () % 100);
+            PUSH (KeyRelease, from, 20 + RND () % 100);
+        }
+        else if (kind < 90)
+        {
+            PUSH (KeyPress, from, 1 + RND () % 50);
+            PUSH (ButtonPress, 1, 20 + RND () % 100);
+            PUSH (ButtonRelease, 1, 20 + RND () % 100);
+            PUSH (KeyRelease, from, 20 + RND () % 100);
+        }
+        else
+        {
+            PUSH (KeyPress, other, 1 + RND () % 50);
+            PUSH (KeyRelease, other, 20 + RND () % 100);
+        }
+    }
+
+#undef PUSH
+#undef RND
+
+    trace->n = n;
+}
+
+/*
+ * A file written by --record-trace, or a text trace with one
+ * "event key_code server_time" line per event
+ */
+Bool read_trace (Trace_t *trace, const char *path)
+{
+    FILE *f = fopen (path, "r");
+    char magic[8];
+    size_t cap = 4096;
+    int type, key;
+    unsigned long time;
+
+    if (f == NULL)
+    {
+        perror (path);
+        return False;
+    }
+
+    if (fread (magic, 1, 8, f) == 8 && memcmp (magic, TRACE_MAGIC, 8) == 0)
+    {
+        fclose (f);
+        return read_trace_file (trace, path);
+    }
+    rewind (f);
+
+    trace->n = 0;
+    trace->events = malloc (cap * sizeof (Event_t));
+    while (fscanf (f, "%d %d %lu", &type, &key, &time) == 3)
+    {
+        if (trace->n == cap)
+        {
+            cap *= 2;
+            trace->events = realloc (trace->events, cap * sizeof (Event_t));
+        }
+        trace->events[trace->n].type = type;
+        trace->events[trace->n].key = key;
+        trace->events[trace->n].time = time;
+        trace->events[trace->n].decision = -1;
+        trace->n++;
+    }
+    fclose (f);
+
+    return True;
+}
+
+Bool read_trace_file (Trace_t *trace, const char *path)
+{
+    TraceFile_t file;
+    const TraceRecord_t *r;
+    uint64_t i;
+
+    if (!trace_open (&file, path))
+        return False;
+
+    trace->n = trace_count (&file);
+    trace->events = malloc ((trace->n + 1) * sizeof (Event_t));
+    for (i = 0; i < trace->n; i++)
+    {
+        r = trace_record (&file, i);
+        trace->events[i].type = r->type;
+        trace->events[i].key = r->key_code;
+        trace->events[i].time = r->server_time;
+        trace->events[i].decision = r->decision;
+    }
+    trace_close (&file);
+
+    return True;
+}
+
+void replay (const Keymap_t *keymap, const char *mapping,
+        const Trace_t *trace, int backlog, Result_t *result)
+{
+    static Engine_t engine;
+    uint64_t *samples = malloc ((trace->n * 3 + 1) * sizeof (uint64_t));
+    char *copy = strdup (mapping);
+    size_t n_samples;
+    uint64_t start;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        memset (&engine, 0, sizeof (engine));
+        engine.timeout = 500;
+        engine.keymap = *keymap;
+        strcpy (copy, mapping);
+
+        allocs = 0;
+        if (!engine_load (&engine, copy))
+        {
+            fprintf (stderr, "Failed to parse_mapping\n");
+            exit (EXIT_FAILURE);
+        }
+        result->load_allocs = allocs;
+
+        /* Throughput first, then again timing every event */
+        allocs = 0;
+        start = now_ns ();
+        n_samples = run (&engine, trace, backlog, pass ? samples : NULL,
+                result);
+        if (pass == 0)
+            result->events_per_sec = n_samples * 1e9 / (now_ns () - start);
+        result->replay_allocs = allocs;
+        result->expired = engine.expired;
+
+        engine_free (&engine);
+    }
+
+    qsort (samples, n_samples, sizeof (uint64_t), compare_u64);
+    result->p50 = samples[n_samples / 2];
+    result->p99 = samples[n_samples * 99 / 100];
+    result->p999 = samples[n_samples * 999 / 1000];
+
+    free (copy);
+    free (samples);
+}
+
+/*
+ * Feeds the trace and the echoes of what the engine generates. An echo
+ * carries the server time of the event that caused it plus 1 ms, but
+ * is only delivered once more than backlog echoes are outstanding,
+ * or never if backlog is negative. Returns the number of events fed.
+ */
+size_t run (Engine_t *engine, const Trace_t *trace, int backlog,
+        uint64_t *samples, Result_t *result)
+{
+    static Event_t echoes[65536];
+    size_t head = 0, tail = 0, fed = 0, i;
+    Decision_t decision;
+    Event_t ev;
+    uint64_t t0 = 0;
+    int j, n;
+
+    result->generated = 0;
+    result->mismatched = 0;
+    for (i = 0; i < trace->n || head != tail; )
+    {
+        if (i < trace->n && (backlog < 0 || tail - head <= backlog))
+            ev = trace->events[i++];
+        else
+            ev = echoes[head++ & 0xffff];
+
+        if (samples)
+            t0 = now_ns ();
+        n = engine_handle_event (engine, ev.type, ev.key, ev.time, &decision);
+        if (samples)
+            samples[fed] = now_ns () - t0;
+        fed++;
+        result->generated += n;
+        if (ev.decision >= 0 && ev.decision != decision)
+            result->mismatched++;
+
+        for (j = 0; j < n && backlog >= 0 && tail - head < 65536; j++, tail++)
+        {
+            echoes[tail & 0xffff].type =
+                engine->actions[j].press ? KeyPress : KeyRelease;
+            echoes[tail & 0xffff].key = engine->actions[j].key;
+            echoes[tail & 0xffff].time = ev.time + 1;
+            echoes[tail & 0xffff].decision = -1;
+        }
+    }
+
+    return fed;
+}
+
+uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void print_usage (const char *program_name)
+{
+    fprintf (stdout, "Usage: %s [-c] [-n events] "
+            "[-r trace_file [-e <mapping>]]\n", program_name);
+    fprintf (stdout, "-c fails if handling events allocates memory\n");
+    fprintf (stdout, "Recordings use a synthetic keymap, give key codes "
+            "in <mapping>, e.g. '#37=#9'\n");
+}
@@ -0,0 +1,330 @@
+/************************************************************************
+ * latency.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * End-to-end latency of a running xcape. Taps a mapped key with XTest
+ * and times, on a separate record context, how long it takes from the
+ * release until the generated key press shows up. Meant to be run by
+ * bench/latency.sh against Xvfb.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/record.h>
+#include <X11/extensions/XTest.h>
+
+/* Log2 histogram buckets of microseconds */
+#define BUCKETS 24
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+typedef struct _Latency_t
+{
+    Display *ctrl_conn;
+    Display *data_conn;
+    XRecordContext record_ctx;
+    KeyCode from;
+    KeyCode to;
+    Bool seen_press;
+    Bool seen_release;
+    uint64_t seen_at;
+} Latency_t;
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void intercept (XPointer user_data, XRecordInterceptData *data);
+
+Bool wait_for (Latency_t *self, Bool *flag, int timeout_ms);
+
+pid_t start_busy_client (void);
+
+uint64_t now_ns (void);
+
+int compare_u64 (const void *a, const void *b);
+
+void print_histogram (const uint64_t *samples, int n, int missed);
+
+void print_usage (const char *program_name);
+
+/************************************************************************
+ * Main function
+ ***********************************************************************/
+int main (int argc, char **argv)
+{
+    Latency_t *self = calloc (1, sizeof (Latency_t));
+    XRecordClientSpec client_spec = XRecordAllClients;
+    XRecordRange *rec_range;
+    const char *from = "Control_L", *to = "Escape";
+    Bool busy = False, switch_group = False;
+    pid_t busy_pid = 0;
+    uint64_t *samples, t0;
+    int ch, i, n = 1000, n_samples = 0, missed = 0, dummy;
+
+    while ((ch = getopt (argc, argv, "n:k:o:bg")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            n = atoi (optarg);
+            break;
+        case 'k':
+            from = optarg;
+            break;
+        case 'o':
+            to = optarg;
+            break;
+        case 'b':
+            busy = True;
+            break;
+        case 'g':
+            switch_group = True;
+            break;
+        default:
+            print_usage (argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    self->ctrl_conn = XOpenDisplay (NULL);
+    self->data_conn = XOpenDisplay (NULL);
+    if (!self->ctrl_conn || !self->data_conn)
+    {
+        fprintf (stderr, "Unable to connect to X11 display. Is $DISPLAY set?\n");
+        return EXIT_FAILURE;
+    }
+    if (!XTestQueryExtension (self->ctrl_conn, &dummy, &dummy, &dummy, &dummy)
+            || !XRecordQueryVersion (self->ctrl_conn, &dummy, &dummy))
+    {
+        fprintf (stderr, "XTEST and RECORD extensions are needed\n");
+        return EXIT_FAILURE;
+    }
+
+    self->from = XKeysymToKeycode (self->ctrl_conn, XStringToKeysym (from));
+    self->to = XKeysymToKeycode (self->ctrl_conn, XStringToKeysym (to));
+    if (self->from == 0 || self->to == 0)
+    {
+        fprintf (stderr, "No key code for %s or %s\n", from, to);
+        return EXIT_FAILURE;
+    }
+
+    rec_range = XRecordAllocRange ();
+    rec_range->device_events.first = KeyPress;
+    rec_range->device_events.last = KeyRelease;
+    self->record_ctx = XRecordCreateContext (self->ctrl_conn,
+            0, &client_spec, 1, &rec_range, 1);
+    XSync (self->ctrl_conn, False);
+    if (self->record_ctx == 0 || !XRecordEnableContextAsync (self->data_conn,
+                self->record_ctx, intercept, (XPointer)self))
+    {
+        fprintf (stderr, "Failed to enable xrecord context\n");
+        return EXIT_FAILURE;
+    }
+
+    if (busy)
+        busy_pid = start_busy_client ();
+
+    samples = calloc (n, sizeof (uint64_t));
+
+    for (i = 0; i < n; i++)
+    {
+        /* A group change from another client, which xcape takes as
+         * the user's (see engine_group_changed ()) and does not lock
+         * back: this times taps that queue behind an XKB state notify */
+        if (switch_group)
+        {
+            XkbLockGroup (self->ctrl_conn, XkbUseCoreKbd, i & 1);
+            XSync (self->ctrl_conn, False);
+        }
+
+        self->seen_press = self->seen_release = False;
+
+        XTestFakeKeyEvent (self->ctrl_conn, self->from, True, 0);
+        XSync (self->ctrl_conn, False);
+        usleep (20000);
+
+        t0 = now_ns ();
+        XTestFakeKeyEvent (self->ctrl_conn, self->from, False, 0);
+        XFlush (self->ctrl_conn);
+
+        if (wait_for (self, &self->seen_press, 1000))
+            samples[n_samples++] = self->seen_at - t0;
+        else
+            missed++;
+
+        wait_for (self, &self->seen_release, 1000);
+    }
+
+    if (busy_pid > 0)
+    {
+        kill (busy_pid, SIGTERM);
+        waitpid (busy_pid, NULL, 0);
+    }
+
+    print_histogram (samples, n_samples, missed);
+
+    XRecordDisableContext (self->ctrl_conn, self->record_ctx);
+    XRecordFreeContext (self->ctrl_conn, self->record_ctx);
+    XFree (rec_range);
+    XCloseDisplay (self->ctrl_conn);
+    XCloseDisplay (self->data_conn);
+    free (samples);
+    free (self);
+
+    return missed == n ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void intercept (XPointer user_data, XRecordInterceptData *data)
+{
+    Latency_t *self = (Latency_t*)user_data;
+
+    if (data->category == XRecordFromServer && data->data[1] == self->to)
+    {
+        if (data->data[0] == KeyPress && !self->seen_press)
+        {
+            self->seen_at = now_ns ();
+            self->seen_press = True;
+        }
+        else if (data->data[0] == KeyRelease)
+        {
+            self->seen_release = True;
+        }
+    }
+
+    XRecordFreeData (data);
+}
+
+Bool wait_for (Latency_t *self, Bool *flag, int timeout_ms)
+{
+    uint64_t deadline = now_ns () + timeout_ms * 1000000ull;
+    struct pollfd pfd;
+
+    pfd.fd = ConnectionNumber (self->data_conn);
+    pfd.events = POLLIN;
+
+    for (;;)
+    {
+        XRecordProcessReplies (self->data_conn);
+        if (*flag)
+            return True;
+        if (now_ns () >= deadline)
+            return False;
+        poll (&pfd, 1, 1);
+    }
+}
+
+/* Keeps the server busy with round trips from another connection */
+pid_t start_busy_client (void)
+{
+    pid_t pid = fork ();
+
+    if (pid == 0)
+    {
+        Display *dpy = XOpenDisplay (NULL);
+        Window root, child;
+        int x, y, wx, wy;
+        unsigned int mask;
+
+        if (dpy == NULL)
+            _exit (EXIT_FAILURE);
+        for (;;)
+        {
+            XQueryPointer (dpy, DefaultRootWindow (dpy), &root, &child,
+                    &x, &y, &wx, &wy, &mask);
+            XDestroyImage (XGetImage (dpy, DefaultRootWindow (dpy),
+                        0, 0, 64, 64, AllPlanes, ZPixmap));
+        }
+    }
+
+    return pid;
+}
+
+uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void print_histogram (const uint64_t *samples, int n, int missed)
+{
+    uint64_t *sorted = malloc ((n + 1) * sizeof (uint64_t));
+    int buckets[BUCKETS], i, b;
+
+    memset (buckets, 0, sizeof (buckets));
+    for (i = 0; i < n; i++)
+    {
+        uint64_t us = samples[i] / 1000;
+
+        for (b = 0; b < BUCKETS - 1 && us >= (2ull << b); b++)
+            ;
+        buckets[b]++;
+        sorted[i] = samples[i];
+    }
+    qsort (sorted, n, sizeof (uint64_t), compare_u64);
+
+    fprintf (stdout, "release to generated press, %d taps, %d missed\n",
+            n + missed, missed);
+    if (n > 0)
+        fprintf (stdout, "p50 %lu us  p99 %lu us  p999 %lu us  max %lu us\n",
+                (unsigned long)(sorted[n / 2] / 1000),
+                (unsigned long)(sorted[n * 99 / 100] / 1000),
+                (unsigned long)(sorted[n * 999 / 1000] / 1000),
+                (unsigned long)(sorted[n - 1] / 1000));
+
+    for (b = 0; b < BUCKETS; b++)
+    {
+        if (buckets[b] > 0)
+            fprintf (stdout, "%10lu us %8d\n",
+                    b == 0 ? 0ul : 1ul << b, buckets[b]);
+    }
+
+    free (sorted);
+}
+
+void print_usage (const char *program_name)
+{
+    fprintf (stdout, "Usage: %s [-n taps] [-k key] [-o generated_key] "
+            "[-b] [-g]\n", program_name);
+    fprintf (stdout, "-b keeps the server busy, -g switches the locked "
+            "group before every tap\n");
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# End-to-end latency of xcape on a private Xvfb server, see latency.c.
+# Run from the top directory by 'make bench-latency'.
+
+XCAPE=${XCAPE:-./xcape}
+LATENCY=${LATENCY:-./bench/xcape-latency}
+TAPS=${TAPS:-500}
+DISPLAY_NUM=${DISPLAY_NUM:-:97}
+
+# Keys of a default US keymap to pad the mapping with
+FILLER="a b c d e f g h i j k l m n o p q r s t u v w x y z
+1 2 3 4 5 6 7 8 9 0 F1 F2 F3 F4 F5 F6 F7 F8 F9 F10 F11 F12"
+
+mapping ()
+{
+    m="Control_L=Escape"
+    i=1
+    for k in $FILLER; do
+        [ $i -ge "$1" ] && break
+        m="$m;$k=Escape"
+        i=$((i + 1))
+    done
+    echo "$m"
+}
+
+Xvfb "$DISPLAY_NUM" -nolisten tcp >/dev/null 2>&1 &
+XVFB=$!
+trap 'kill $XVFB 2>/dev/null' EXIT INT TERM
+export DISPLAY="$DISPLAY_NUM"
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    xdpyinfo >/dev/null 2>&1 && break
+    sleep 0.5
+done
+
+# Xvfb has a single group, so -g would lock group 1 to no effect
+if ! setxkbmap -layout us,de; then
+    echo "setxkbmap failed, -g does not switch groups" >&2
+fi
+
+for n in 1 16 48; do
+    for opts in "" "-b" "-g"; do
+        echo "== $n mappings ${opts:+($opts)}"
+        "$XCAPE" -f -e "$(mapping $n)" &
+        XCAPE_PID=$!
+        sleep 0.5
+        "$LATENCY" -n "$TAPS" $opts
+        kill $XCAPE_PID
+        wait $XCAPE_PID 2>/dev/null
+    done
+done
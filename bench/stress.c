@@ -0,0 +1,400 @@
+/************************************************************************
+ * stress.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Sustained load on a running xcape. Injects a scripted mix of taps,
+ * holds, modifier use and plain typing with XTest at a fixed event rate,
+ * then checks what xcape decided, as read back from its --record-trace
+ * file, against what the script intended. Meant to be run by
+ * bench/stress.sh against Xvfb, with a fresh trace for every run.
+ *
+ * Records the ring overwrote cannot be accounted for, so a run is
+ * shortened to fit the ring, and one that wrapped anyway is reported
+ * as inconclusive (exit status 2) rather than as failing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XTest.h>
+
+#include "../engine.h"
+#include "../trace.h"
+
+/* Margin kept from the timeout so that a tap is unambiguous */
+#define MARGIN_MS 100
+
+/* Events a run may inject, the rest of the trace ring is for echoes */
+#define RUN_EVENTS (TRACE_RECORDS * 3 / 4)
+
+#define EXIT_WRAPPED 2
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+typedef struct _Inject_t
+{
+    uint64_t at;                /* ns from the start */
+    KeyCode key;
+    Bool press;
+} Inject_t;
+
+typedef struct _Script_t
+{
+    Inject_t *events;
+    size_t n, cap;
+    Decision_t *expected;       /* one per release of the mapped key */
+    size_t n_expected;
+} Script_t;
+
+typedef struct _Report_t
+{
+    size_t releases;            /* releases of the mapped key in the trace */
+    size_t missing;             /* expected releases not in the trace */
+    size_t dropped;             /* taps that generated nothing */
+    size_t wrong_timeout;       /* taps decided as held too long */
+    size_t spurious;            /* holds or uses that generated a key */
+    size_t unsuppressed;        /* generated events taken as user input */
+    long max_pending;           /* most generated events awaiting echo */
+    long final_pending;
+    Bool wrapped;               /* records of the run were overwritten */
+} Report_t;
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void make_script (Script_t *script, Display *dpy, KeyCode from,
+        unsigned rate, unsigned seconds, unsigned timeout);
+
+void script_add (Script_t *script, uint64_t at, KeyCode key, Bool press);
+
+void inject (Display *dpy, const Script_t *script);
+
+Bool account (const char *trace_path, uint64_t start, KeyCode from,
+        KeyCode to, const Script_t *script, Report_t *report);
+
+uint64_t now_ns (void);
+
+void print_usage (const char *program_name);
+
+/************************************************************************
+ * Main function
+ ***********************************************************************/
+int main (int argc, char **argv)
+{
+    const char *from_name = "Control_L", *to_name = "Escape";
+    const char *trace_path = NULL;
+    unsigned rate = 1000, seconds = 10, timeout = 500;
+    Script_t script;
+    Report_t report;
+    Display *dpy;
+    KeyCode from, to;
+    uint64_t start, elapsed;
+    int ch;
+
+    while ((ch = getopt (argc, argv, "r:s:t:k:o:T:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'r':
+            rate = strtoul (optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = strtoul (optarg, NULL, 0);
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'k':
+            from_name = optarg;
+            break;
+        case 'o':
+            to_name = optarg;
+            break;
+        case 'T':
+            timeout = strtoul (optarg, NULL, 0);
+            break;
+        default:
+            print_usage (argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (trace_path == NULL || rate == 0)
+    {
+        print_usage (argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((uint64_t)rate * seconds > RUN_EVENTS)
+    {
+        seconds = RUN_EVENTS / rate;
+        if (seconds == 0)
+            seconds = 1;
+        fprintf (stderr, "Shortening the run to %u s to fit the trace "
+                "ring\n", seconds);
+    }
+
+    dpy = XOpenDisplay (NULL);
+    if (dpy == NULL)
+    {
+        fprintf (stderr, "Unable to connect to X11 display. Is $DISPLAY set?\n");
+        return EXIT_FAILURE;
+    }
+
+    from = XKeysymToKeycode (dpy, XStringToKeysym (from_name));
+    to = XKeysymToKeycode (dpy, XStringToKeysym (to_name));
+    if (from == 0 || to == 0)
+    {
+        fprintf (stderr, "No key code for %s or %s\n", from_name, to_name);
+        return EXIT_FAILURE;
+    }
+
+    memset (&script, 0, sizeof (script));
+    make_script (&script, dpy, from, rate, seconds, timeout);
+
+    start = now_ns ();
+    inject (dpy, &script);
+    elapsed = now_ns () - start;
+
+    /* Let xcape catch up and expire what it is still waiting for */
+    sleep (2);
+
+    if (!account (trace_path, start, from, to, &script, &report))
+        return EXIT_FAILURE;
+
+    if (report.wrapped)
+    {
+        fprintf (stdout, "%u events/s for %u s: the trace ring wrapped, "
+                "not accounted\n", rate, seconds);
+        XCloseDisplay (dpy);
+        free (script.events);
+        free (script.expected);
+        return EXIT_WRAPPED;
+    }
+
+    fprintf (stdout, "%u events/s for %u s: %zu events, %.0f events/s "
+            "achieved, %zu taps/holds/uses\n", rate, seconds, script.n,
+            script.n * 1e9 / elapsed, script.n_expected);
+    fprintf (stdout, "  missing from trace   %zu\n", report.missing);
+    fprintf (stdout, "  dropped taps         %zu\n", report.dropped);
+    fprintf (stdout, "  wrongly timed out    %zu\n", report.wrong_timeout);
+    fprintf (stdout, "  spurious taps        %zu\n", report.spurious);
+    fprintf (stdout, "  unsuppressed echoes  %zu\n", report.unsuppressed);
+    fprintf (stdout, "  pending echoes       max %ld, at end %ld\n",
+            report.max_pending, report.final_pending);
+
+    XCloseDisplay (dpy);
+    free (script.events);
+    free (script.expected);
+
+    return report.missing + report.dropped + report.wrong_timeout
+        + report.spurious + report.unsuppressed > 0
+        ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/*
+ * Events are spaced 1/rate apart except inside holds. Mostly plain
+ * typing, with taps, holds past the timeout and uses as a modifier of
+ * the mapped key mixed in, and the expected decision for each.
+ */
+void make_script (Script_t *script, Display *dpy, KeyCode from,
+        unsigned rate, unsigned seconds, unsigned timeout)
+{
+    uint64_t gap = 1000000000ull / rate, end = seconds * 1000000000ull;
+    uint64_t t = 0;
+    uint32_t rnd = 2463534242u;
+    KeyCode letters[26];
+    char name[2] = "a";
+    int i;
+
+    for (i = 0; i < 26; i++, name[0]++)
+        letters[i] = XKeysymToKeycode (dpy, XStringToKeysym (name));
+
+    script->expected = malloc ((rate * seconds + 1) * sizeof (Decision_t));
+
+#define RND() (rnd ^= rnd << 13, rnd ^= rnd >> 17, rnd ^= rnd << 5, rnd)
+
+    while (t < end)
+    {
+        uint32_t kind = RND () % 1000;
+        KeyCode other = letters[RND () % 26];
+
+        if (kind < 30)
+        {
+            /* Quick taps, typing stops while the key is down */
+            uint64_t hold = (5 + RND () % 50) * 1000000ull;
+            if (hold > timeout * 500000ull)
+                hold = timeout * 500000ull;
+            if (hold < gap)
+                hold = gap;
+            script_add (script, t, from, True);
+            script_add (script, t += hold, from, False);
+            script->expected[script->n_expected++] = DECISION_TAP;
+        }
+        else if (kind < 32)
+        {
+            script_add (script, t, from, True);
+            script_add (script, t += (timeout + MARGIN_MS) * 1000000ull,
+                    from, False);
+            script->expected[script->n_expected++] = DECISION_TIMEOUT;
+        }
+        else if (kind < 60)
+        {
+            script_add (script, t, from, True);
+            script_add (script, t += gap, other, True);
+            script_add (script, t += gap, other, False);
+            script_add (script, t += gap, from, False);
+            script->expected[script->n_expected++] = DECISION_USED;
+        }
+        else
+        {
+            script_add (script, t, other, True);
+            script_add (script, t += gap, other, False);
+        }
+        t += gap;
+    }
+
+#undef RND
+}
+
+void script_add (Script_t *script, uint64_t at, KeyCode key, Bool press)
+{
+    if (script->n == script->cap)
+    {
+        script->cap = script->cap ? script->cap * 2 : 4096;
+        script->events = realloc (script->events,
+                script->cap * sizeof (Inject_t));
+    }
+    script->events[script->n].at = at;
+    script->events[script->n].key = key;
+    script->events[script->n++].press = press;
+}
+
+void inject (Display *dpy, const Script_t *script)
+{
+    struct timespec ts;
+    uint64_t start = now_ns (), at;
+    size_t i;
+
+    for (i = 0; i < script->n; i++)
+    {
+        at = start + script->events[i].at;
+        ts.tv_sec = at / 1000000000;
+        ts.tv_nsec = at % 1000000000;
+        clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        XTestFakeKeyEvent (dpy, script->events[i].key,
+                script->events[i].press, 0);
+        XFlush (dpy);
+    }
+    XSync (dpy, False);
+}
+
+/*
+ * The script never presses the generated key, so every event on it is
+ * an echo and must be suppressed. Each TAP owes two echoes.
+ */
+Bool account (const char *trace_path, uint64_t start, KeyCode from,
+        KeyCode to, const Script_t *script, Report_t *report)
+{
+    TraceFile_t trace;
+    const TraceRecord_t *r;
+    uint64_t i, n;
+    long pending = 0;
+
+    memset (report, 0, sizeof (Report_t));
+
+    if (!trace_open (&trace, trace_path))
+        return False;
+
+    /* The oldest record left is from the run, earlier ones are lost */
+    n = trace_count (&trace);
+    if (n > 0 && trace_record (&trace, 0)->recv_ns >= start
+            && trace.header->head > n)
+    {
+        report->wrapped = True;
+        trace_close (&trace);
+        return True;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        r = trace_record (&trace, i);
+        if (r->recv_ns < start)
+            continue;
+
+        if (r->key_code == to)
+        {
+            if (r->decision == DECISION_SUPPRESSED)
+                pending--;
+            else
+                report->unsuppressed++;
+        }
+        else if (r->key_code == from && r->type == KeyRelease)
+        {
+            Decision_t expected = report->releases < script->n_expected
+                ? script->expected[report->releases] : DECISION_NONE;
+
+            if (expected == DECISION_TAP && r->decision == DECISION_TIMEOUT)
+                report->wrong_timeout++;
+            else if (expected == DECISION_TAP && r->decision != DECISION_TAP)
+                report->dropped++;
+            else if (expected != DECISION_TAP && r->decision == DECISION_TAP)
+                report->spurious++;
+
+            if (r->decision == DECISION_TAP)
+                pending += 2;
+            report->releases++;
+        }
+
+        if (pending > report->max_pending)
+            report->max_pending = pending;
+    }
+
+    if (report->releases < script->n_expected)
+        report->missing = script->n_expected - report->releases;
+    report->final_pending = pending;
+
+    trace_close (&trace);
+    return True;
+}
+
+uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void print_usage (const char *program_name)
+{
+    fprintf (stdout, "Usage: %s -t xcape_trace_file [-r events_per_s] "
+            "[-s seconds] [-k key] [-o generated_key] [-T timeout_ms]\n",
+            program_name);
+}
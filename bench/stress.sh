@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Raises the injected event rate on a private Xvfb server until xcape
+# starts deciding wrongly, see stress.c. Run from the top directory by
+# 'make bench-stress'. Every rate gets a new xcape and trace, so no run
+# shares the trace ring with an earlier one.
+
+XCAPE=${XCAPE:-./xcape}
+STRESS=${STRESS:-./bench/xcape-stress}
+SECONDS_PER_RATE=${SECONDS_PER_RATE:-10}
+DISPLAY_NUM=${DISPLAY_NUM:-:98}
+TRACE=${TRACE:-/tmp/xcape-stress.$$.trace}
+
+Xvfb "$DISPLAY_NUM" -nolisten tcp >/dev/null 2>&1 &
+XVFB=$!
+trap 'kill $XVFB 2>/dev/null; rm -f "$TRACE"' EXIT INT TERM
+export DISPLAY="$DISPLAY_NUM"
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    xdpyinfo >/dev/null 2>&1 && break
+    sleep 0.5
+done
+
+for rate in 250 500 1000 2000 4000 8000; do
+    rm -f "$TRACE"
+    "$XCAPE" -f -e "Control_L=Escape" --record-trace "$TRACE" &
+    XCAPE_PID=$!
+    sleep 0.5
+
+    "$STRESS" -t "$TRACE" -r $rate -s "$SECONDS_PER_RATE"
+    status=$?
+
+    kill $XCAPE_PID
+    wait $XCAPE_PID 2>/dev/null
+
+    # 2: the ring wrapped, inconclusive rather than failing
+    [ $status -eq 0 ] || [ $status -eq 2 ] || break
+done
@@ -0,0 +1,256 @@
+/************************************************************************
+ * cache.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+/* FNV-1a */
+#define FP_BASIS 14695981039346656037ull
+#define FP_PRIME 1099511628211ull
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+uint64_t fingerprint (uint64_t fp, const void *data, size_t size);
+
+size_t cache_size (uint32_t n_maps, uint32_t n_keys, uint32_t n_profiles);
+
+/************************************************************************
+ * Cache interface
+ ***********************************************************************/
+/* Covers every key sym the engine may look up when parsing */
+uint64_t cache_keymap_fingerprint (const Keymap_t *keymap)
+{
+    uint64_t fp = FP_BASIS;
+    uint32_t ks;
+    int kc, group, level;
+
+    fp = fingerprint (fp, &keymap->min_key_code, sizeof (int));
+    fp = fingerprint (fp, &keymap->max_key_code, sizeof (int));
+
+    for (kc = keymap->min_key_code; kc <= keymap->max_key_code; kc++)
+    {
+        fp = fingerprint (fp, &keymap->groups[kc], 1);
+        fp = fingerprint (fp, &keymap->width[kc], 1);
+
+        for (group = 0; group < keymap->groups[kc]
+                && group < KEYMAP_GROUPS; group++)
+        {
+            for (level = 0; level < keymap->width[kc]
+                    && level < KEYMAP_LEVELS; level++)
+            {
+                ks = keymap->syms[kc][group][level];
+                fp = fingerprint (fp, &ks, sizeof (ks));
+            }
+        }
+    }
+
+    return fp;
+}
+
+uint64_t cache_source_fingerprint (const char *mapping)
+{
+    return fingerprint (FP_BASIS, mapping, strlen (mapping));
+}
+
+/* Store the mapping engine has loaded, parsed from text with source_fp */
+Bool cache_write (const char *path, const Engine_t *engine,
+        uint64_t source_fp)
+{
+    CacheHeader_t *header;
+    ResolvedMap_t *maps;
+    ResolvedKey_t *keys;
+    char (*names)[PROFILE_NAME_SIZE];
+    const char *profiles[ENGINE_PROFILES];
+    const KeyMap_t *km;
+    const Key_t *k;
+    uint32_t n_keys = 0, n_profiles = 0, p;
+    char *tmp = malloc (strlen (path) + 5);
+    size_t size;
+    Bool ok;
+    FILE *f;
+    int kc;
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+            n_keys++;
+        for (p = 0; p < n_profiles && profiles[p] != km->profile; p++)
+            ;
+        if (p == n_profiles)
+            profiles[n_profiles++] = km->profile;
+    }
+
+    size = cache_size (engine->n_maps, n_keys, n_profiles);
+    header = calloc (1, size);
+    maps = (ResolvedMap_t *)(header + 1);
+    keys = (ResolvedKey_t *)(maps + engine->n_maps);
+    names = (char (*)[PROFILE_NAME_SIZE])(keys + n_keys);
+
+    memcpy (header->magic, CACHE_MAGIC, 8);
+    header->keymap_fp = cache_keymap_fingerprint (&engine->keymap);
+    header->source_fp = source_fp;
+    header->n_maps = engine->n_maps;
+    header->n_keys = n_keys;
+    header->n_profiles = n_profiles;
+    for (p = 0; p < n_profiles; p++)
+        strncpy (names[p], profiles[p], PROFILE_NAME_SIZE - 1);
+    for (kc = 0; kc < 256; kc++)
+        header->dispatch[kc] = engine->dispatch[kc] != NULL
+            ? engine->dispatch[kc]->index + 1 : 0;
+
+    for (km = engine->map; km != NULL; km = km->next, maps++)
+    {
+        maps->from_ks = km->UseKeyCode ? NoSymbol : km->from_ks;
+        maps->from_kc = km->from_kc;
+        maps->use_key_code = km->UseKeyCode;
+        for (p = 0; profiles[p] != km->profile; p++)
+            ;
+        maps->profile = p;
+        for (k = km->to_keys; k != NULL; k = k->next, keys++)
+        {
+            keys->ks = k->ks;
+            keys->key = k->key;
+            maps->n_keys++;
+        }
+    }
+
+    /* Another xcape starting meanwhile only ever sees a complete file */
+    sprintf (tmp, "%s.new", path);
+    f = fopen (tmp, "w");
+    ok = f != NULL && fwrite (header, size, 1, f) == 1;
+    if (f != NULL && fclose (f) != 0)
+        ok = False;
+    if (!ok || rename (tmp, path) < 0)
+    {
+        perror (tmp);
+        free (header);
+        free (tmp);
+        return False;
+    }
+    free (header);
+    free (tmp);
+
+    return True;
+}
+
+/*
+ * Load the mapping stored at path into engine. Returns False, and
+ * leaves engine alone, if there is none or if it was compiled from
+ * other mapping text or against another keymap than engine->keymap.
+ */
+Bool cache_load (const char *path, Engine_t *engine, uint64_t source_fp)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    const CacheHeader_t *header;
+    const ResolvedMap_t *maps;
+    const ResolvedKey_t *keys;
+    const char *why = NULL;
+    struct stat st;
+    Bool rval = False;
+    uint64_t n_keys = 0;
+    uint32_t i;
+    void *p;
+
+    if (fd < 0 || fstat (fd, &st) < 0)
+    {
+        if (engine->debug)
+            perror (path);
+        if (fd >= 0)
+            close (fd);
+        return False;
+    }
+
+    p = st.st_size >= sizeof (CacheHeader_t)
+        ? mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close (fd);
+    header = p;
+
+    if (p == MAP_FAILED || memcmp (header->magic, CACHE_MAGIC, 8) != 0
+            || cache_size (header->n_maps, header->n_keys,
+                header->n_profiles) != st.st_size)
+        why = "not a compiled mapping";
+    else if (header->source_fp != source_fp)
+        why = "compiled from another mapping";
+    else if (header->keymap_fp != cache_keymap_fingerprint (&engine->keymap))
+        why = "compiled against another keymap";
+
+    /* The keys of the maps must be the ones in the file, no more */
+    if (why == NULL)
+    {
+        maps = (const ResolvedMap_t *)(header + 1);
+        for (i = 0; i < header->n_maps; i++)
+            n_keys += maps[i].n_keys;
+        if (n_keys != header->n_keys)
+            why = "not a compiled mapping";
+    }
+
+    if (why == NULL)
+    {
+        maps = (const ResolvedMap_t *)(header + 1);
+        keys = (const ResolvedKey_t *)(maps + header->n_maps);
+        rval = engine_load_resolved (engine, maps, header->n_maps, keys,
+                header->dispatch,
+                (const char (*)[PROFILE_NAME_SIZE])(keys + header->n_keys),
+                header->n_profiles);
+        if (!rval)
+            why = "no mappings";
+    }
+
+    if (engine->debug)
+    {
+        if (rval)
+            fprintf (stderr, "Loaded %d mappings from %s\n",
+                    engine->n_maps, path);
+        else
+            fprintf (stderr, "Not using %s: %s\n", path, why);
+    }
+
+    if (p != MAP_FAILED)
+        munmap (p, st.st_size);
+
+    return rval;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+uint64_t fingerprint (uint64_t fp, const void *data, size_t size)
+{
+    const unsigned char *c = data;
+
+    while (size-- > 0)
+        fp = (fp ^ *c++) * FP_PRIME;
+
+    return fp;
+}
+
+size_t cache_size (uint32_t n_maps, uint32_t n_keys, uint32_t n_profiles)
+{
+    return sizeof (CacheHeader_t) + n_maps * sizeof (ResolvedMap_t)
+        + n_keys * sizeof (ResolvedKey_t) + n_profiles * PROFILE_NAME_SIZE;
+}
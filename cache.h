@@ -0,0 +1,70 @@
+/************************************************************************
+ * cache.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Precompiled mappings, 'xcape --compile FILE' and 'xcape --cache FILE'.
+ * The file holds the mapping as resolved against the keymap it was
+ * compiled on, with fingerprints of that keymap and of the mapping
+ * text. At startup it is mapped and loaded without parsing or looking
+ * up any key names, as long as both fingerprints still match.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+#define CACHE_MAGIC "XCMAP002"
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+/*
+ * Followed by n_maps ResolvedMap_t, n_keys ResolvedKey_t and the names
+ * of n_profiles profiles, PROFILE_NAME_SIZE bytes each
+ */
+typedef struct _CacheHeader_t
+{
+    char magic[8];
+    uint64_t keymap_fp;         /* see cache_keymap_fingerprint() */
+    uint64_t source_fp;         /* see cache_source_fingerprint() */
+    uint32_t n_maps;
+    uint32_t n_keys;
+    uint32_t n_profiles;
+    uint32_t pad;
+    uint16_t dispatch[256];     /* per key code mapping index + 1, or 0 */
+} CacheHeader_t;
+
+/************************************************************************
+ * Cache interface
+ ***********************************************************************/
+uint64_t cache_keymap_fingerprint (const Keymap_t *keymap);
+
+uint64_t cache_source_fingerprint (const char *mapping);
+
+Bool cache_write (const char *path, const Engine_t *engine,
+        uint64_t source_fp);
+
+Bool cache_load (const char *path, Engine_t *engine, uint64_t source_fp);
+
+#endif /* CACHE_H */
@@ -0,0 +1,494 @@
+/************************************************************************
+ * control.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "xcape.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void client_accept (XCape_t *self);
+
+void client_read (XCape_t *self, Client_t *c);
+
+void client_write (XCape_t *self, Client_t *c);
+
+void client_close (XCape_t *self, Client_t *c);
+
+void run_command (XCape_t *self, char *line, FILE *out);
+
+Bool edit_mapping (XCape_t *self, const char *add, const char *remove,
+        FILE *out);
+
+void print_stats (Session_t *self, FILE *out);
+
+void run_display (XCape_t *self, char *arg, FILE *out);
+
+void print_display (Session_t *session, FILE *out);
+
+void print_display_stats (Session_t *session, FILE *out);
+
+/************************************************************************
+ * Control interface
+ ***********************************************************************/
+Bool control_open (XCape_t *self, const char *path)
+{
+    Control_t *ctl = &self->control;
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    struct stat st;
+    int i;
+
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+        ctl->clients[i].fd = -1;
+    ctl->path = path;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "Control socket path too long: %s\n", path);
+        return False;
+    }
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    ctl->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl->fd < 0)
+    {
+        perror ("socket");
+        return False;
+    }
+
+    /* Replace a socket left by an earlier run, but nothing else */
+    if (lstat (path, &st) == 0)
+    {
+        if (!S_ISSOCK (st.st_mode))
+        {
+            fprintf (stderr, "Not a socket, not removing: %s\n", path);
+            return False;
+        }
+        unlink (path);
+    }
+
+    if (bind (ctl->fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+            || listen (ctl->fd, CONTROL_CLIENTS) < 0)
+    {
+        perror (path);
+        return False;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = ctl->fd;
+    if (epoll_ctl (self->session.epoll_fd, EPOLL_CTL_ADD, ctl->fd, &ev) < 0)
+    {
+        perror ("epoll_ctl");
+        return False;
+    }
+
+    return True;
+}
+
+Bool control_handle (XCape_t *self, int fd, uint32_t events)
+{
+    Control_t *ctl = &self->control;
+    int i;
+
+    if (ctl->path == NULL)
+        return False;
+
+    if (fd == ctl->fd)
+    {
+        client_accept (self);
+        return True;
+    }
+
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+    {
+        Client_t *c = &ctl->clients[i];
+
+        if (c->fd != fd)
+            continue;
+
+        if (events & EPOLLOUT)
+            client_write (self, c);
+        if (c->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            client_read (self, c);
+        return True;
+    }
+
+    return False;
+}
+
+void control_close (XCape_t *self)
+{
+    Control_t *ctl = &self->control;
+    int i;
+
+    if (ctl->path == NULL)
+        return;
+
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+    {
+        if (ctl->clients[i].fd >= 0)
+            client_close (self, &ctl->clients[i]);
+    }
+    close (ctl->fd);
+    unlink (ctl->path);
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void client_accept (XCape_t *self)
+{
+    Control_t *ctl = &self->control;
+    struct epoll_event ev;
+    int fd, i;
+
+    while ((fd = accept4 (ctl->fd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        for (i = 0; i < CONTROL_CLIENTS && ctl->clients[i].fd >= 0; i++)
+            ;
+        if (i == CONTROL_CLIENTS)
+        {
+            close (fd);
+            continue;
+        }
+
+        memset (&ctl->clients[i], 0, sizeof (Client_t));
+        ctl->clients[i].fd = fd;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl (self->session.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void client_read (XCape_t *self, Client_t *c)
+{
+    char *nl, *reply;
+    size_t reply_len;
+    ssize_t n;
+    FILE *out;
+
+    n = read (c->fd, c->in + c->in_len, CONTROL_LINE - c->in_len);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            client_close (self, c);
+        return;
+    }
+    c->in_len += n;
+
+    /* Replies are queued in order, a client may send several lines */
+    while ((nl = memchr (c->in, '\n', c->in_len)) != NULL)
+    {
+        *nl = '\0';
+        if (nl > c->in && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        out = open_memstream (&reply, &reply_len);
+        run_command (self, c->in, out);
+        fclose (out);
+
+        c->out = realloc (c->out, c->out_len + reply_len);
+        memcpy (c->out + c->out_len, reply, reply_len);
+        c->out_len += reply_len;
+        free (reply);
+
+        c->in_len -= nl + 1 - c->in;
+        memmove (c->in, nl + 1, c->in_len);
+    }
+
+    if (c->in_len == CONTROL_LINE)
+    {
+        client_close (self, c);
+        return;
+    }
+
+    client_write (self, c);
+}
+
+/* Sends what it can, and waits for EPOLLOUT for the rest */
+void client_write (XCape_t *self, Client_t *c)
+{
+    struct epoll_event ev;
+    ssize_t n;
+
+    while (c->out_sent < c->out_len)
+    {
+        n = send (c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                client_close (self, c);
+                return;
+            }
+            break;
+        }
+        c->out_sent += n;
+    }
+
+    if (c->out_sent == c->out_len)
+    {
+        free (c->out);
+        c->out = NULL;
+        c->out_len = c->out_sent = 0;
+    }
+
+    ev.events = c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl (self->session.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_close (XCape_t *self, Client_t *c)
+{
+    epoll_ctl (self->session.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close (c->fd);
+    free (c->out);
+    memset (c, 0, sizeof (Client_t));
+    c->fd = -1;
+}
+
+void run_command (XCape_t *self, char *line, FILE *out)
+{
+    char *cmd = strtok (line, " \t");
+    char *arg = strtok (NULL, "");
+    char name[MAPPING_NAME_SIZE];
+    KeyMap_t *km;
+
+    if (arg != NULL)
+        arg += strspn (arg, " \t");
+
+    if (cmd == NULL)
+    {
+        fprintf (out, "error empty command\n");
+    }
+    else if (strcmp (cmd, "display") == 0)
+    {
+        run_display (self, arg, out);
+    }
+    else if (self->pool.n_workers > 0
+            && (strcmp (cmd, "add") == 0 || strcmp (cmd, "remove") == 0
+                || strcmp (cmd, "reload") == 0
+                || (strcmp (cmd, "timeout") == 0 && arg != NULL
+                    && *arg != '\0')))
+    {
+        fprintf (out, "error the mapping of --displays cannot change\n");
+    }
+    else if (strcmp (cmd, "list") == 0)
+    {
+        for (km = self->session.engine.map; km != NULL; km = km->next)
+        {
+            engine_mapping_name (km, name, sizeof (name));
+            fprintf (out, "%d %s\n", km->index, name);
+        }
+        fprintf (out, "ok\n");
+    }
+    else if (strcmp (cmd, "add") == 0 && arg != NULL && *arg != '\0')
+    {
+        if (edit_mapping (self, arg, NULL, out))
+            fprintf (out, "ok\n");
+    }
+    else if (strcmp (cmd, "remove") == 0 && arg != NULL && *arg != '\0')
+    {
+        if (edit_mapping (self, NULL, arg, out))
+            fprintf (out, "ok\n");
+    }
+    else if (strcmp (cmd, "timeout") == 0)
+    {
+        int ms = arg != NULL && *arg != '\0' ? atoi (arg) : 0;
+
+        if (arg != NULL && *arg != '\0' && ms <= 0)
+        {
+            fprintf (out, "error invalid timeout\n");
+            return;
+        }
+        if (ms > 0)
+            self->session.engine.timeout = ms;
+        fprintf (out, "%lu\nok\n", (unsigned long)self->session.engine.timeout);
+    }
+    else if (strcmp (cmd, "stats") == 0)
+    {
+        if (self->pool.n_workers > 0)
+            pool_foreach (self, print_display_stats, out);
+        else
+            print_stats (&self->session, out);
+        fprintf (out, "ok\n");
+    }
+    else if (strcmp (cmd, "reload") == 0)
+    {
+        if (reload_mapping (self))
+            fprintf (out, "ok\n");
+        else
+            fprintf (out, "error mapping did not parse\n");
+    }
+    else
+    {
+        fprintf (out, "error unknown command or missing argument\n");
+    }
+}
+
+/*
+ * Rebuild the mapping from the names of the mappings in use, without
+ * remove and with add appended. A profile marker carries over to the
+ * following mappings, so those of the default profile get one too.
+ */
+Bool edit_mapping (XCape_t *self, const char *add, const char *remove,
+        FILE *out)
+{
+    char name[MAPPING_NAME_SIZE], *mapping, *bare;
+    size_t len;
+    FILE *m;
+    KeyMap_t *km;
+    Bool found = False, first = True, ok;
+
+    m = open_memstream (&mapping, &len);
+    for (km = self->session.engine.map; km != NULL; km = km->next)
+    {
+        engine_mapping_name (km, name, sizeof (name));
+        bare = name[0] == '[' ? strchr (name, ']') + 1 : name;
+        if (remove != NULL && (strcmp (name, remove) == 0
+                    || strcmp (bare, remove) == 0
+                    || (strncmp (bare, remove, strlen (remove)) == 0
+                        && bare[strlen (remove)] == '=')
+                    || (remove[strspn (remove, "0123456789")] == '\0'
+                        && atoi (remove) == km->index)))
+        {
+            found = True;
+            continue;
+        }
+        fprintf (m, "%s%s%s", first ? "" : ";",
+                name[0] == '[' ? "" : "[default]", name);
+        first = False;
+    }
+    if (add != NULL)
+        fprintf (m, "%s%s%s", first ? "" : ";",
+                add[0] == '[' ? "" : "[default]", add);
+    fclose (m);
+
+    if (remove != NULL && !found)
+    {
+        fprintf (out, "error no such mapping\n");
+        ok = False;
+    }
+    else if (len == 0)
+    {
+        fprintf (out, "error cannot remove the last mapping\n");
+        ok = False;
+    }
+    else if (!(ok = switch_mapping (self, mapping)))
+    {
+        fprintf (out, "error mapping did not parse\n");
+    }
+
+    free (mapping);
+    return ok;
+}
+
+void print_stats (Session_t *self, FILE *out)
+{
+    char name[MAPPING_NAME_SIZE];
+    const MapCounters_t *c;
+    KeyMap_t *km;
+
+    for (km = self->engine.map; km != NULL; km = km->next)
+    {
+        c = &self->engine.counters[km->index];
+        engine_mapping_name (km, name, sizeof (name));
+        fprintf (out, "%s presses %llu taps %llu used %llu mouse %llu "
+                "timeouts %llu suppressed %llu\n", name,
+                (unsigned long long)c->presses,
+                (unsigned long long)c->taps,
+                (unsigned long long)c->used,
+                (unsigned long long)c->mouse,
+                (unsigned long long)c->timeouts,
+                (unsigned long long)c->suppressed);
+    }
+    fprintf (out, "expired %lu\n", self->engine.expired);
+    dump_startup (self, out);
+    dump_histograms (self, out);
+}
+
+/* display [list], display add <display> or display remove <display> */
+void run_display (XCape_t *self, char *arg, FILE *out)
+{
+    char *cmd = arg != NULL ? strtok (arg, " \t") : NULL;
+    char *display = cmd != NULL ? strtok (NULL, " \t") : NULL;
+
+    if (self->pool.n_workers == 0)
+    {
+        fprintf (out, "error not started with --displays\n");
+    }
+    else if (cmd == NULL || strcmp (cmd, "list") == 0)
+    {
+        pool_foreach (self, print_display, out);
+        fprintf (out, "ok\n");
+    }
+    else if (strcmp (cmd, "add") == 0 && display != NULL)
+    {
+        if (pool_add (self, display))
+            fprintf (out, "ok\n");
+        else
+            fprintf (out, "error cannot serve display %s\n", display);
+    }
+    else if (strcmp (cmd, "remove") == 0 && display != NULL)
+    {
+        if (pool_remove (self, display))
+            fprintf (out, "ok\n");
+        else
+            fprintf (out, "error no such display\n");
+    }
+    else
+    {
+        fprintf (out, "error unknown command or missing argument\n");
+    }
+}
+
+void print_display (Session_t *session, FILE *out)
+{
+    fprintf (out, "%s worker %d%s%s\n", session->display,
+            (int)(session->worker - session->worker->pool->workers),
+            session->engine.shared ? " shared" : "",
+            session->closing ? " closing" : "");
+}
+
+/* Read while its worker writes, which a few odd counts can live with */
+void print_display_stats (Session_t *session, FILE *out)
+{
+    fprintf (out, "display %s\n", session->display);
+    print_stats (session, out);
+}
@@ -0,0 +1,82 @@
+/************************************************************************
+ * control.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * The control socket, 'xcape --control PATH'. A line based protocol on
+ * a Unix stream socket, served by the event loop between key events:
+ *
+ *   list                   the mappings in use, one per line
+ *   add <expression>       add mappings, as given to -e, to the profile
+ *                          "default" unless it starts with [<profile>]
+ *   remove <mapping>       remove a mapping, by name or by number
+ *   timeout [<ms>]         show or set -t
+ *   stats                  per-mapping counters and histograms
+ *   reload                 read the mapping source again, as SIGHUP
+ *   display [list]         with --displays, the displays served
+ *   display add <display>  serve one more display
+ *   display remove <display>
+ *
+ * Every reply ends with a line "ok" or "error <reason>".
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE 1024
+
+struct _XCape_t;
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _Client_t
+{
+    int fd;                 /* -1 if unused */
+    size_t in_len;
+    char in[CONTROL_LINE];
+    char *out;              /* reply not yet sent */
+    size_t out_len;
+    size_t out_sent;
+} Client_t;
+
+typedef struct _Control_t
+{
+    int fd;                 /* listening socket, -1 without --control */
+    const char *path;
+    Client_t clients[CONTROL_CLIENTS];
+} Control_t;
+
+/************************************************************************
+ * Control interface
+ ***********************************************************************/
+Bool control_open (struct _XCape_t *self, const char *path);
+
+/* Returns False if fd is not one of the control socket's */
+Bool control_handle (struct _XCape_t *self, int fd, uint32_t events);
+
+void control_close (struct _XCape_t *self);
+
+#endif /* CONTROL_H */
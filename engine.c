@@ -0,0 +1,989 @@
+/************************************************************************
+ * engine.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+#include "engine.h"
+#include "keysym.h"
+#include "probes.h"
+
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+int handle_key (Engine_t *engine, KeyMap_t *key, KeyCode key_code,
+        int key_event, Time now, Decision_t *decision);
+
+KeyMap_t *parse_mapping (const Keymap_t *keymap, char *mapping,
+        Arena_t *arena, KeyMap_t **dispatch, Bool debug);
+
+void switch_to (Engine_t *engine, Arena_t *arena, KeyMap_t *map,
+        KeyMap_t **dispatch);
+
+int build_dispatch (const Keymap_t *keymap, KeyMap_t *map,
+        KeyMap_t **dispatch, int first, int last, Bool debug);
+
+const char *find_profile (Arena_t *arena, const char **profiles,
+        int *n_profiles, const char *name);
+
+void warn_overlaps (KeyMap_t *map, KeyMap_t **dispatch);
+
+Action_t *alloc_actions (Engine_t *engine);
+
+void mark_outputs (Engine_t *engine);
+
+void suppress_add (Engine_t *engine, KeyCode key, Time now,
+        unsigned short owner);
+
+Bool suppress_match (Engine_t *engine, KeyCode key, Time now);
+
+Bool unshare (Engine_t *engine);
+
+Bool arena_init (Arena_t *arena, size_t n_maps, size_t n_keys);
+
+void *arena_alloc (Arena_t *arena, size_t size);
+
+Key_t *key_add_key (Arena_t *arena, Key_t *keys, KeyCode key, KeySym ks);
+
+/************************************************************************
+ * Engine interface
+ ***********************************************************************/
+/*
+ * Parse mapping and switch to it. May be called again to replace the
+ * mapping: the new tables are built completely before anything is
+ * switched, and on failure the old mapping stays. Press state is per
+ * key code and kept; a held key that is no longer mapped is released
+ * without generating anything.
+ *
+ * A token "[name]" puts the mappings after it, in the same token and
+ * up to the next such token, in profile name; mappings before the
+ * first are in profile "default". Two profiles mapping the same key
+ * code fail the load.
+ */
+Bool engine_load (Engine_t *engine, char *mapping)
+{
+    KeyMap_t *dispatch[256];
+    KeyMap_t *map;
+    Arena_t arena;
+
+    map = parse_mapping (&engine->keymap, mapping, &arena,
+            dispatch, engine->debug);
+
+    if (map == NULL)
+    {
+        free (arena.base);
+        return False;
+    }
+
+    engine->shared = False;
+    switch_to (engine, &arena, map, dispatch);
+
+    return True;
+}
+
+/*
+ * Like engine_load(), but with n_maps mappings resolved earlier against
+ * the same keymap and dispatch[] holding, per key code, the index of its
+ * mapping plus one, or 0. Nothing is looked up or checked again.
+ */
+Bool engine_load_resolved (Engine_t *engine, const ResolvedMap_t *maps,
+        int n_maps, const ResolvedKey_t *keys, const uint16_t *dispatch,
+        const char (*profiles)[PROFILE_NAME_SIZE], int n_profiles)
+{
+    KeyMap_t *table[256], **byindex, *map = NULL, **next = &map;
+    const char *names[ENGINE_PROFILES];
+    Arena_t arena;
+    int i, j, kc, n_keys = 0;
+
+    for (i = 0; i < n_maps; i++)
+    {
+        n_keys += maps[i].n_keys;
+        if (maps[i].profile >= n_profiles)
+            return False;
+    }
+
+    /* A name takes no more room than a mapping */
+    byindex = malloc ((n_maps + 1) * sizeof (KeyMap_t *));
+    if (n_maps == 0 || n_profiles > ENGINE_PROFILES || byindex == NULL
+            || !arena_init (&arena, n_maps + n_profiles, n_keys))
+    {
+        free (byindex);
+        return False;
+    }
+
+    for (i = 0; i < n_profiles; i++)
+    {
+        char *name = arena_alloc (&arena, PROFILE_NAME_SIZE);
+
+        strncpy (name, profiles[i], PROFILE_NAME_SIZE - 1);
+        names[i] = name;
+    }
+
+    for (i = 0; i < n_maps; i++)
+    {
+        KeyMap_t *km = arena_alloc (&arena, sizeof (KeyMap_t));
+
+        km->profile = names[maps[i].profile];
+        km->UseKeyCode = maps[i].use_key_code;
+        km->from_ks = maps[i].from_ks;
+        km->from_kc = maps[i].from_kc;
+        for (j = 0; j < maps[i].n_keys; j++, keys++)
+            km->to_keys = key_add_key (&arena, km->to_keys,
+                    keys->key, keys->ks);
+
+        byindex[i] = *next = km;
+        next = &km->next;
+    }
+
+    for (kc = 0; kc < 256; kc++)
+        table[kc] = dispatch[kc] > 0 && dispatch[kc] <= n_maps
+            ? byindex[dispatch[kc] - 1] : NULL;
+    free (byindex);
+
+    engine->shared = False;
+    switch_to (engine, &arena, map, table);
+
+    return True;
+}
+
+/*
+ * Use the mapping of from, loaded for the same keymap, without copying
+ * it. engine gets counters and actions of its own and keeps its key
+ * state; the mapping is copied only once engine's keymap changes, see
+ * engine_keymap_changed (). from must not change or go away before.
+ */
+Bool engine_share (Engine_t *engine, const Engine_t *from)
+{
+    KeyMap_t *km;
+    Key_t *k;
+    Arena_t arena;
+    size_t n_keys = 0;
+
+    for (km = from->map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+            n_keys++;
+    }
+
+    arena.size = from->n_maps * sizeof (MapCounters_t)
+        + (2 * n_keys + 2) * sizeof (Action_t) + 2 * sizeof (void *);
+    arena.used = 0;
+    arena.base = malloc (arena.size);
+    if (from->map == NULL || arena.base == NULL)
+    {
+        free (arena.base);
+        return False;
+    }
+
+    engine->shared = True;
+    switch_to (engine, &arena, from->map, (KeyMap_t **)from->dispatch);
+
+    return True;
+}
+
+void engine_free (Engine_t *engine)
+{
+    free (engine->arena.base);
+    memset (&engine->arena, 0, sizeof (engine->arena));
+    engine->shared = False;
+    engine->map = NULL;
+    engine->counters = NULL;
+    engine->actions = NULL;
+}
+
+/*
+ * Count into the caller's array of engine->n_maps counters from now on,
+ * e.g. one that others can read
+ */
+void engine_use_counters (Engine_t *engine, MapCounters_t *counters)
+{
+    memcpy (counters, engine->counters,
+            engine->n_maps * sizeof (MapCounters_t));
+    engine->counters = counters;
+}
+/*
+ * The mapping as it would be given to -e, e.g. "Control_L=Escape" or
+ * "[work]Shift_L=space"
+ */
+void engine_mapping_name (const KeyMap_t *km, char *buf, size_t size)
+{
+    const Key_t *k;
+    size_t n = 0;
+
+    /* As parsed, "[name]" only for other profiles than the default */
+    if (km->profile != NULL && strcmp (km->profile, "default") != 0)
+        n = snprintf (buf, size, "[%s]", km->profile);
+
+    if (km->UseKeyCode && n < size)
+        n += snprintf (buf + n, size - n, "#%d=", km->from_kc);
+    else if (n < size)
+        n += snprintf (buf + n, size - n, "%s=", keysym_name (km->from_ks));
+
+    for (k = km->to_keys; k != NULL && n < size; k = k->next)
+    {
+        if (k->ks != NoSymbol)
+            n += snprintf (buf + n, size - n, "%s%s",
+                    k == km->to_keys ? "" : "|", keysym_name (k->ks));
+        else
+            n += snprintf (buf + n, size - n, "%s#%d",
+                    k == km->to_keys ? "" : "|", k->key);
+    }
+}
+
+/*
+ * Feed one recorded key or button event to the engine. Returns the
+ * number of key events left in engine->actions for the caller to
+ * generate, in order, and what was decided in *decision.
+ */
+int engine_handle_event (Engine_t *engine, int key_event, KeyCode key_code,
+        Time now, Decision_t *decision)
+{
+    KeyMap_t *km = NULL;
+    int i;
+
+    *decision = DECISION_NONE;
+
+    if (suppress_match (engine, key_code, now))
+    {
+        *decision = DECISION_SUPPRESSED;
+        return 0;
+    }
+
+    if (key_event == ButtonPress)
+    {
+        engine->mouse_pressed = True;
+    }
+    else if (key_event == ButtonRelease)
+    {
+        engine->mouse_pressed = False;
+    }
+    else
+    {
+        km = engine->dispatch[key_code];
+    }
+
+    /* Any press marks the other currently pressed mappings as used */
+    if (key_event == KeyPress || key_event == ButtonPress)
+    {
+        for (i = 0; i < engine->n_pressed; i++)
+        {
+            KeyState_t *st = &engine->state[engine->pressed[i]];
+
+            if ((km == NULL || engine->pressed[i] != key_code)
+                    && st->used == USED_NONE)
+                st->used = key_event == ButtonPress ? USED_MOUSE : USED_KEY;
+        }
+    }
+
+    if (km != NULL)
+        PROBE2 (match, key_code, km->index);
+
+    /* A key can lose its mapping while held if the keymap changes */
+    if (km != NULL || (key_event == KeyRelease
+                && engine->state[key_code].pressed == True))
+    {
+        return handle_key (engine, km, key_code, key_event, now, decision);
+    }
+
+    return 0;
+}
+
+/* The caller has updated count key codes of engine->keymap from first */
+void engine_keymap_changed (Engine_t *engine, int first, int count)
+{
+    KeyMap_t *km;
+    Key_t *k;
+
+    if (engine->shared && !unshare (engine))
+    {
+        fprintf (stderr, "Failed to copy the mapping, "
+                "ignoring the keymap change\n");
+        return;
+    }
+
+    build_dispatch (&engine->keymap, engine->map, engine->dispatch,
+            first, first + count - 1, engine->debug);
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+        {
+            if (k->ks != NoSymbol)
+                k->key = keymap_code (&engine->keymap, k->ks);
+        }
+    }
+
+    mark_outputs (engine);
+}
+
+/*
+ * A generated key can switch the locked group, e.g. when it is only
+ * found in another layout. Returns True if the caller should lock
+ * engine->intended_group again, any other change is taken as the one
+ * the user wants.
+ *
+ * The server reports key events injected with XTest like typed ones,
+ * so a change at when by key_code is ours if key_code still owes an
+ * echo, or if its last echo had the same server time: the change and
+ * the echo arrive on different connections, in either order.
+ */
+Bool engine_group_changed (Engine_t *engine, int group,
+        KeyCode key_code, Time when)
+{
+    Pending_t *p = &engine->generated[key_code];
+
+    if (engine->output[key_code] && (p->count > 0 || p->echoed == when))
+        return group != engine->intended_group;
+
+    engine->intended_group = group;
+    return False;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+int handle_key (Engine_t *engine, KeyMap_t *key, KeyCode key_code,
+        int key_event, Time now, Decision_t *decision)
+{
+    KeyState_t *st = &engine->state[key_code];
+    Key_t *k;
+    int n = 0;
+
+    if (key_event == KeyPress)
+    {
+        if (st->pressed == False)
+        {
+            st->slot = engine->n_pressed;
+            engine->pressed[engine->n_pressed++] = key_code;
+            engine->counters[key->index].presses++;
+        }
+        st->pressed = True;
+
+        st->down_at = now;
+
+        if (engine->mouse_pressed)
+        {
+            st->used = USED_MOUSE;
+        }
+        *decision = DECISION_PRESSED;
+    }
+    else
+    {
+        if (key == NULL)
+        {
+            *decision = DECISION_UNMAPPED;
+        }
+        else if (st->used != USED_NONE)
+        {
+            *decision = st->used == USED_MOUSE
+                ? DECISION_MOUSE : DECISION_USED;
+            if (st->used == USED_MOUSE)
+                engine->counters[key->index].mouse++;
+            else
+                engine->counters[key->index].used++;
+        }
+        else if (st->pressed == False)
+        {
+            *decision = DECISION_NONE;
+        }
+        /* Both times come from the server, so a client that falls
+         * behind the event stream does not turn taps into holds */
+        else if ((Time)(unsigned int)(now - st->down_at) >= engine->timeout)
+        {
+            *decision = DECISION_TIMEOUT;
+            engine->counters[key->index].timeouts++;
+        }
+        else
+        {
+            for (k = key->to_keys; k != NULL; k = k->next)
+            {
+                if (k->key == 0)
+                    continue;
+                engine->actions[n].key = k->key;
+                engine->actions[n++].press = True;
+                suppress_add (engine, k->key, now, key->index);
+            }
+            for (k = key->to_keys; k != NULL; k = k->next)
+            {
+                if (k->key == 0)
+                    continue;
+                engine->actions[n].key = k->key;
+                engine->actions[n++].press = False;
+                suppress_add (engine, k->key, now, key->index);
+            }
+            *decision = DECISION_TAP;
+            engine->counters[key->index].taps++;
+            PROBE3 (tap, key_code, key->index, n);
+        }
+
+        if (*decision > DECISION_TAP)
+            PROBE4 (reject, key_code, key != NULL ? key->index : -1,
+                    *decision, (unsigned int)(now - st->down_at));
+
+        if (st->pressed == True)
+        {
+            /* Move the last pressed key code into the freed slot */
+            KeyCode last = engine->pressed[--engine->n_pressed];
+            engine->pressed[st->slot] = last;
+            engine->state[last].slot = st->slot;
+        }
+        st->used = USED_NONE;
+        st->pressed = False;
+    }
+
+    return n;
+}
+
+/* Take over a complete new mapping, see engine_load() */
+void switch_to (Engine_t *engine, Arena_t *arena, KeyMap_t *map,
+        KeyMap_t **dispatch)
+{
+    KeyMap_t *km;
+    int kc;
+
+    free (engine->arena.base);
+    engine->arena = *arena;
+    engine->map = map;
+    memcpy (engine->dispatch, dispatch, sizeof (engine->dispatch));
+
+    /* Echoes still pending were generated by mappings now gone */
+    for (kc = 0; kc < 256; kc++)
+        engine->generated[kc].owner = 0xffff;
+
+    /* A shared mapping was indexed by its owner */
+    engine->n_maps = 0;
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        if (!engine->shared)
+            km->index = engine->n_maps;
+        engine->n_maps++;
+    }
+
+    engine->counters = arena_alloc (&engine->arena,
+            engine->n_maps * sizeof (MapCounters_t));
+    engine->actions = alloc_actions (engine);
+    mark_outputs (engine);
+}
+
+/*
+ * Give engine a copy of the mapping it shares, in a new arena along with
+ * its counters, unless they are in a stats file, and its actions. Key
+ * state and pending echoes stay as they are, indices do not change.
+ */
+Bool unshare (Engine_t *engine)
+{
+    KeyMap_t *table[256], **byindex, *map = NULL, **next = &map, *km;
+    MapCounters_t *counters = engine->counters;
+    Arena_t arena;
+    Key_t *k;
+    int kc, n_keys = 0;
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+            n_keys++;
+    }
+
+    byindex = malloc ((engine->n_maps + 1) * sizeof (KeyMap_t *));
+    if (byindex == NULL || !arena_init (&arena, engine->n_maps, n_keys))
+    {
+        free (byindex);
+        return False;
+    }
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        KeyMap_t *copy = arena_alloc (&arena, sizeof (KeyMap_t));
+
+        copy->UseKeyCode = km->UseKeyCode;
+        copy->from_ks = km->from_ks;
+        copy->from_kc = km->from_kc;
+        copy->index = km->index;
+        /* Profile names stay with the owner, which outlives engine */
+        copy->profile = km->profile;
+        for (k = km->to_keys; k != NULL; k = k->next)
+            copy->to_keys = key_add_key (&arena, copy->to_keys,
+                    k->key, k->ks);
+
+        byindex[km->index] = *next = copy;
+        next = &copy->next;
+    }
+
+    for (kc = 0; kc < 256; kc++)
+        table[kc] = engine->dispatch[kc] != NULL
+            ? byindex[engine->dispatch[kc]->index] : NULL;
+    free (byindex);
+
+    /* Counters in the old arena move along, those of --stats stay */
+    if ((char *)counters >= engine->arena.base
+            && (char *)counters < engine->arena.base + engine->arena.size)
+    {
+        counters = arena_alloc (&arena,
+                engine->n_maps * sizeof (MapCounters_t));
+        memcpy (counters, engine->counters,
+                engine->n_maps * sizeof (MapCounters_t));
+    }
+
+    free (engine->arena.base);
+    engine->arena = arena;
+    engine->map = map;
+    engine->counters = counters;
+    memcpy (engine->dispatch, table, sizeof (engine->dispatch));
+    engine->actions = alloc_actions (engine);
+    engine->shared = False;
+
+    return True;
+}
+
+/* Room for n_maps mappings of n_keys keys in all, and what goes with them */
+Bool arena_init (Arena_t *arena, size_t n_maps, size_t n_keys)
+{
+    arena->size = n_maps * (sizeof (KeyMap_t) + sizeof (void *))
+        + n_keys * (sizeof (Key_t) + sizeof (void *))
+        + (2 * n_keys + 2) * sizeof (Action_t)
+        + n_maps * sizeof (MapCounters_t) + 2 * sizeof (void *);
+    arena->used = 0;
+    arena->base = malloc (arena->size);
+
+    return arena->base != NULL;
+}
+
+void *arena_alloc (Arena_t *arena, size_t size)
+{
+    void *rval;
+
+    size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+    if (arena->used + size > arena->size)
+        return NULL;
+
+    rval = arena->base + arena->used;
+    arena->used += size;
+    memset (rval, 0, size);
+
+    return rval;
+}
+
+Key_t *key_add_key (Arena_t *arena, Key_t *keys, KeyCode key, KeySym ks)
+{
+    Key_t *rval = keys;
+
+    if (keys == NULL)
+    {
+        keys = arena_alloc (arena, sizeof (Key_t));
+        rval = keys;
+    }
+    else
+    {
+        while (keys->next != NULL) keys = keys->next;
+        keys = (keys->next = arena_alloc (arena, sizeof (Key_t)));
+    }
+
+    keys->key = key;
+    keys->ks = ks;
+    keys->next = NULL;
+
+    return rval;
+}
+
+KeyMap_t *parse_token (const Keymap_t *keymap, char *token,
+        Arena_t *arena, Bool debug)
+{
+    KeyMap_t *km = NULL;
+    KeySym    ks;
+    char      *from, *to, *key;
+    KeyCode   code;           /* keycode */
+    long      parsed_code;    /* parsed keycode value */
+    size_t    mark = arena->used;
+
+    to = token;
+    from = strsep (&to, "=");
+    if (to != NULL)
+    {
+        km = arena_alloc (arena, sizeof (KeyMap_t));
+
+        if (!strncmp (from, "#", 1)
+               && strsep (&from, "#") != NULL)
+        {
+            errno = 0;
+            parsed_code = strtoul (from, NULL, 0); /* dec, oct, hex automatically */
+            if (errno == 0
+                   && parsed_code <=255
+                   && keymap_sym (keymap, (KeyCode) parsed_code, 0, 0) != NoSymbol)
+            {
+                km->UseKeyCode = True;
+                km->from_kc = (KeyCode) parsed_code;
+                if (debug)
+                {
+                  KeySym ks_temp = keymap_sym (keymap, (KeyCode) parsed_code, 0, 0);
+                  fprintf(stderr, "Assigned mapping from \"%s\" ( keysym 0x%x, "
+                          "key code %d)\n",
+                          keysym_name (ks_temp),
+                          (unsigned) ks_temp,
+                          (unsigned) km->from_kc);
+                }
+            }
+            else
+            {
+                fprintf (stderr, "Invalid keycode: %s\n", from);
+                goto fail;
+            }
+        }
+        else
+        {
+            if ((ks = keysym_lookup (from)) == NoSymbol)
+            {
+                fprintf (stderr, "Invalid key: %s\n", token);
+                goto fail;
+            }
+
+            km->UseKeyCode  = False;
+            km->from_ks     = ks;
+            km->to_keys     = NULL;
+
+            if (debug)
+            {
+              fprintf(stderr, "Assigned mapping from \"%s\" ( keysym 0x%x, "
+                      "key code %d)\n",
+                      keysym_name (km->from_ks),
+                      (unsigned) km->from_ks,
+                      (unsigned) keymap_code (keymap, km->from_ks));
+            }
+        }
+
+        for(;;)
+        {
+            key = strsep (&to, "|");
+            if (key == NULL)
+                break;
+
+            if (!strncmp (key, "#", 1)
+                   && strsep (&key, "#") != NULL)
+            {
+                errno = 0;
+                parsed_code = strtoul (key, NULL, 0); /* dec, oct, hex automatically */
+                if (!(errno == 0
+                      && parsed_code <=255
+                      && keymap_sym (keymap, (KeyCode) parsed_code, 0, 0) != NoSymbol))
+                {
+                    fprintf (stderr, "Invalid keycode: %s\n", key);
+                    goto fail;
+                }
+
+                code = (KeyCode) parsed_code;
+                ks = NoSymbol;
+            }
+            else
+            {
+                if ((ks = keysym_lookup (key)) == NoSymbol)
+                {
+                    fprintf (stderr, "Invalid key: %s\n", key);
+                    goto fail;
+                }
+
+                code = keymap_code (keymap, ks);
+                if (code == 0)
+                {
+                    fprintf (stderr, "WARNING: No keycode found for keysym "
+                            "%s (0x%x) in mapping %s. Ignoring this "
+                            "mapping.\n", key, (unsigned int)ks, token);
+                    goto fail;
+                }
+            }
+
+            km->to_keys = key_add_key (arena, km->to_keys, code, ks);
+            if (debug)
+            {
+              KeySym ks_temp = keymap_sym (keymap, code, 0, 0);
+              fprintf(stderr, "to \"%s\" (keysym 0x%x, key code %d)\n",
+                  keysym_name (ks_temp),
+                  (unsigned) ks_temp,
+                  (unsigned) code);
+            }
+        }
+    }
+    else
+        fprintf (stderr, "WARNING: Mapping without = has no effect: '%s'\n", token);
+
+    return km;
+
+fail:
+    /* Give back everything this token took from the arena */
+    arena->used = mark;
+    return NULL;
+}
+
+KeyMap_t *parse_mapping (const Keymap_t *keymap, char *mapping,
+        Arena_t *arena, KeyMap_t **dispatch, Bool debug)
+{
+    char     *token, *c, *end;
+    KeyMap_t *rval, *km, *nkm;
+    size_t   n_maps = 1, n_keys = 0;
+    const char *profiles[ENGINE_PROFILES], *profile = NULL;
+    int      n_profiles = 0;
+
+    rval = km = NULL;
+
+    /* Every token is a mapping and every separator may start a key. A
+     * profile name takes no more room than a mapping, one more for
+     * "default". */
+    for (c = mapping; *c != '\0'; c++)
+    {
+        if (*c == ';' || *c == '[')
+            n_maps++;
+        else if (*c == '=' || *c == '|')
+            n_keys++;
+    }
+
+    if (!arena_init (arena, n_maps + 1, n_keys))
+        return NULL;
+
+    for(;;)
+    {
+        token = strsep (&mapping, ";");
+        if (token == NULL)
+            break;
+
+        if (token[0] == '[')
+        {
+            end = strchr (token, ']');
+            if (end != NULL)
+                *end = '\0';
+            profile = end != NULL ? find_profile (arena, profiles,
+                    &n_profiles, token + 1) : NULL;
+            if (profile == NULL)
+            {
+                fprintf (stderr, "Invalid profile name: '%s'\n", token + 1);
+                return NULL;
+            }
+            token = end + 1;
+            if (*token == '\0')
+                continue;
+        }
+
+        nkm = parse_token (keymap, token, arena, debug);
+
+        if (nkm != NULL)
+        {
+            if (profile == NULL)
+                profile = find_profile (arena, profiles, &n_profiles,
+                        "default");
+            nkm->profile = profile;
+
+            if (km == NULL)
+                rval = km = nkm;
+            else
+            {
+                km->next = nkm;
+                km = nkm;
+            }
+        }
+    }
+
+    if (build_dispatch (keymap, rval, dispatch, 0, 255, debug) > 0)
+        return NULL;
+    warn_overlaps (rval, dispatch);
+
+    return rval;
+}
+
+/* The one copy of name in arena, added unless there are too many */
+const char *find_profile (Arena_t *arena, const char **profiles,
+        int *n_profiles, const char *name)
+{
+    char *copy;
+    int i;
+
+    for (i = 0; i < *n_profiles; i++)
+    {
+        if (strcmp (profiles[i], name) == 0)
+            return profiles[i];
+    }
+
+    if (*n_profiles == ENGINE_PROFILES || name[0] == '\0'
+            || strlen (name) >= PROFILE_NAME_SIZE)
+        return NULL;
+
+    copy = arena_alloc (arena, strlen (name) + 1);
+    strcpy (copy, name);
+    profiles[(*n_profiles)++] = copy;
+
+    return copy;
+}
+
+/* Echoes are suppressed before dispatch, so the other profile never
+ * sees them, unlike with an xcape for each */
+void warn_overlaps (KeyMap_t *map, KeyMap_t **dispatch)
+{
+    KeyMap_t *km;
+    Key_t *k;
+
+    for (km = map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+        {
+            if (dispatch[k->key] != NULL
+                    && dispatch[k->key]->profile != km->profile)
+                fprintf (stderr, "WARNING: Profile %s generates key code %d, "
+                        "which profile %s maps\n", km->profile, k->key,
+                        dispatch[k->key]->profile);
+        }
+    }
+}
+
+/* Returns the number of key codes mapped by more than one profile */
+int build_dispatch (const Keymap_t *keymap, KeyMap_t *map,
+        KeyMap_t **dispatch, int first, int last, Bool debug)
+{
+    KeyMap_t *km;
+    int kc, conflicts = 0;
+
+    for (kc = first; kc <= last; kc++)
+    {
+        dispatch[kc] = NULL;
+
+        for (km = map; km != NULL; km = km->next)
+        {
+            if ((km->UseKeyCode == True && kc != km->from_kc)
+                    || (km->UseKeyCode == False
+                        && keymap_sym (keymap, kc, 0, 0) != km->from_ks))
+                continue;
+
+            if (dispatch[kc] != NULL && dispatch[kc]->profile != km->profile)
+            {
+                fprintf (stderr, "Key code %d is mapped by profiles %s "
+                        "and %s\n", kc, dispatch[kc]->profile, km->profile);
+                conflicts++;
+                continue;
+            }
+            if (dispatch[kc] != NULL)
+            {
+                fprintf (stderr, "WARNING: Key code %d is already mapped, "
+                        "ignoring later mapping\n", kc);
+                continue;
+            }
+
+            dispatch[kc] = km;
+            if (debug) fprintf (stderr, "Dispatching key code %d\n", kc);
+        }
+    }
+
+    return conflicts;
+}
+
+/* Room for pressing and releasing every key of the longest mapping */
+Action_t *alloc_actions (Engine_t *engine)
+{
+    KeyMap_t *km;
+    Key_t *k;
+    int n, max = 1;
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        for (n = 0, k = km->to_keys; k != NULL; k = k->next)
+            n++;
+        if (n > max)
+            max = n;
+    }
+
+    return arena_alloc (&engine->arena, 2 * max * sizeof (Action_t));
+}
+
+void mark_outputs (Engine_t *engine)
+{
+    KeyMap_t *km;
+    Key_t *k;
+
+    memset (engine->output, 0, sizeof (engine->output));
+
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        for (k = km->to_keys; k != NULL; k = k->next)
+            engine->output[k->key] = True;
+    }
+    engine->output[0] = False;
+}
+
+void suppress_add (Engine_t *engine, KeyCode key, Time now,
+        unsigned short owner)
+{
+    Pending_t *p = &engine->generated[key];
+
+    if (p->count < 0xffff)
+        p->count++;
+    p->owner = owner;
+    p->expires = now + GENERATED_TIMEOUT;
+}
+
+/* Consume one generated event for key, dropping it if it went stale */
+Bool suppress_match (Engine_t *engine, KeyCode key, Time now)
+{
+    Pending_t *p = &engine->generated[key];
+
+    if (p->count == 0)
+        return False;
+
+    if ((int)(now - p->expires) > 0)
+    {
+        engine->expired += p->count;
+        p->count = 0;
+        return False;
+    }
+
+    p->count--;
+    p->echoed = now;
+    PROBE2 (suppress, key, p->owner);
+    if (p->owner < engine->n_maps)
+        engine->counters[p->owner].suppressed++;
+    return True;
+}
+
+KeySym keymap_sym (const Keymap_t *keymap, KeyCode code,
+        int group, int level)
+{
+    if (group >= keymap->groups[code] || level >= keymap->width[code])
+        return NoSymbol;
+
+    return keymap->syms[code][group][level];
+}
+
+/* Like XKeysymToKeycode, but prefers lower groups and levels */
+KeyCode keymap_code (const Keymap_t *keymap, KeySym ks)
+{
+    int group, level, kc;
+
+    for (group = 0; group < KEYMAP_GROUPS; group++)
+    {
+        for (level = 0; level < KEYMAP_LEVELS; level++)
+        {
+            for (kc = keymap->min_key_code; kc <= keymap->max_key_code; kc++)
+            {
+                if (keymap_sym (keymap, kc, group, level) == ks)
+                    return kc;
+            }
+        }
+    }
+
+    return 0;
+}
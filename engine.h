@@ -0,0 +1,217 @@
+/************************************************************************
+ * engine.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * The tap/hold decision engine (libxcape). It does no I/O: feed it key
+ * and button events with their server time and it returns the key
+ * events to generate. The X11 types below are used for their values
+ * only, the engine never talks to a display, and key names are looked
+ * up in the tables of keysym.c, so it needs no libX11 either.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+
+/* How long (ms of server time) a generated event waits for its echo */
+#define GENERATED_TIMEOUT 1000
+
+/* Profiles of one mapping, and room for the name of one */
+#define ENGINE_PROFILES 256
+#define PROFILE_NAME_SIZE 32
+
+/* Size of the resolved keymap kept for every key code */
+#define KEYMAP_GROUPS 4
+#define KEYMAP_LEVELS 8
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _Key_t
+{
+    KeyCode key;
+    KeySym ks;              /* NoSymbol if given as a key code */
+    struct _Key_t *next;
+} Key_t;
+
+typedef struct _KeyMap_t
+{
+    Bool UseKeyCode;        /* (for from) instead of KeySym; ignore latter */
+    KeySym from_ks;
+    KeyCode from_kc;
+    Key_t *to_keys;
+    unsigned short index;   /* position in the mapping, for counters */
+    const char *profile;    /* one string per profile, see engine_load() */
+    struct _KeyMap_t *next;
+} KeyMap_t;
+
+/* Monotonic counters of one mapping, see engine_use_counters() */
+typedef struct _MapCounters_t
+{
+    uint64_t presses;
+    uint64_t taps;
+    uint64_t used;          /* cancelled because another key was pressed */
+    uint64_t mouse;         /* cancelled by a mouse button */
+    uint64_t timeouts;
+    uint64_t suppressed;    /* echoes of its generated keys */
+} MapCounters_t;
+
+/* Why a pressed mapping will not generate its keys */
+typedef enum _Used_t
+{
+    USED_NONE = 0,
+    USED_KEY,               /* another key was pressed meanwhile */
+    USED_MOUSE              /* a mouse button was pressed */
+} Used_t;
+
+/*
+ * A mapping resolved against a keymap, flat so that it can be stored,
+ * see cache.h. Its n_keys keys follow those of the mappings before it.
+ */
+typedef struct _ResolvedMap_t
+{
+    uint32_t from_ks;       /* NoSymbol if given as a key code */
+    uint8_t from_kc;
+    uint8_t use_key_code;
+    uint8_t profile;        /* index in the profile names stored along */
+    uint8_t pad;
+    uint16_t n_keys;
+} ResolvedMap_t;
+
+typedef struct _ResolvedKey_t
+{
+    uint32_t ks;            /* NoSymbol if given as a key code */
+    uint8_t key;
+    uint8_t pad[3];
+} ResolvedKey_t;
+
+/* Hot per-keycode state, kept apart from the parse-time KeyMap_t data */
+typedef struct _KeyState_t
+{
+    unsigned char used;     /* Used_t */
+    Bool pressed;
+    unsigned char slot;     /* index in Engine_t.pressed while pressed */
+    Time down_at;           /* server time of the press */
+} KeyState_t;
+
+/* Single allocation holding everything engine_load() builds */
+typedef struct _Arena_t
+{
+    char *base;
+    size_t size;
+    size_t used;
+} Arena_t;
+
+/* Generated events of one key code not yet seen by the engine */
+typedef struct _Pending_t
+{
+    unsigned short count;
+    unsigned short owner;   /* index of the mapping that generated last */
+    Time expires;           /* server time after which count is stale */
+    Time echoed;            /* server time of the last echo seen */
+} Pending_t;
+
+/* Keysyms of all groups and levels, filled in by the caller */
+typedef struct _Keymap_t
+{
+    int min_key_code;
+    int max_key_code;
+    unsigned char groups[256];  /* number of groups of each key code */
+    unsigned char width[256];   /* levels per group of each key code */
+    KeySym syms[256][KEYMAP_GROUPS][KEYMAP_LEVELS];
+} Keymap_t;
+
+/* What the engine made of one event */
+typedef enum _Decision_t
+{
+    DECISION_NONE = 0,      /* not a mapped key */
+    DECISION_SUPPRESSED,    /* echo of a generated event */
+    DECISION_PRESSED,       /* a mapped key went down */
+    DECISION_TAP,           /* a mapped key was tapped, keys generated */
+    DECISION_USED,          /* released after another key was pressed */
+    DECISION_MOUSE,         /* released after a mouse button was pressed */
+    DECISION_TIMEOUT,       /* released after the timeout */
+    DECISION_UNMAPPED       /* released after its mapping went away */
+} Decision_t;
+
+/* A key event the caller should generate */
+typedef struct _Action_t
+{
+    KeyCode key;
+    Bool press;
+} Action_t;
+
+typedef struct _Engine_t
+{
+    Bool debug;
+    Time timeout;               /* in ms of server time */
+    Keymap_t keymap;
+    Arena_t arena;              /* owns map, its keys and actions */
+    Bool shared;                /* map is another engine's, see engine_share */
+    KeyMap_t *map;
+    int n_maps;
+    MapCounters_t *counters;    /* indexed by KeyMap_t.index */
+    KeyMap_t *dispatch[256];    /* indexed by KeyCode, NULL if unmapped */
+    KeyState_t state[256];      /* indexed by KeyCode */
+    KeyCode pressed[256];       /* key codes of currently pressed mappings */
+    int n_pressed;
+    Bool mouse_pressed;
+    Bool output[256];           /* key codes the engine may generate */
+    Pending_t generated[256];   /* indexed by KeyCode */
+    unsigned long expired;      /* generated events that never came back */
+    unsigned char intended_group;
+    Action_t *actions;          /* result of the last engine_handle_event */
+} Engine_t;
+
+/************************************************************************
+ * Engine interface
+ ***********************************************************************/
+Bool engine_load (Engine_t *engine, char *mapping);
+
+Bool engine_load_resolved (Engine_t *engine, const ResolvedMap_t *maps,
+        int n_maps, const ResolvedKey_t *keys, const uint16_t *dispatch,
+        const char (*profiles)[PROFILE_NAME_SIZE], int n_profiles);
+
+Bool engine_share (Engine_t *engine, const Engine_t *from);
+
+void engine_free (Engine_t *engine);
+
+void engine_use_counters (Engine_t *engine, MapCounters_t *counters);
+
+void engine_mapping_name (const KeyMap_t *km, char *buf, size_t size);
+
+int engine_handle_event (Engine_t *engine, int key_event, KeyCode key_code,
+        Time now, Decision_t *decision);
+
+void engine_keymap_changed (Engine_t *engine, int first, int count);
+
+Bool engine_group_changed (Engine_t *engine, int group,
+        KeyCode key_code, Time when);
+
+KeySym keymap_sym (const Keymap_t *keymap, KeyCode code,
+        int group, int level);
+
+KeyCode keymap_code (const Keymap_t *keymap, KeySym ks);
+
+#endif /* ENGINE_H */
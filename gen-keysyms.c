@@ -0,0 +1,342 @@
+/************************************************************************
+ * gen-keysyms.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Build-time generator of keysym-table.h, the key name tables of
+ * keysym.c. Reads the '#define <vendor>XK_<name> <value>' lines of the
+ * given headers, e.g. keysymdef.h and XF86keysym.h, and names them
+ * <vendor><name> the way Xlib does. Names are placed by a minimal
+ * perfect hash (hash and displace): the first hash picks a bucket, and
+ * the bucket's displacement seeds the second hash, which picks a slot
+ * of its own for every name.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Names per bucket, on average */
+#define BUCKET_LOAD 4
+
+/************************************************************************
+ * Internal data types
+ ***********************************************************************/
+typedef struct _Name_t
+{
+    char *name;
+    uint64_t hash;          /* keysym_hash() of name */
+    uint32_t value;
+    int order;              /* position in the headers */
+} Name_t;
+
+typedef struct _Bucket_t
+{
+    int index;
+    int n;
+    int *names;
+} Bucket_t;
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+int read_header (const char *path, Name_t **names, int *n, int *cap);
+
+uint64_t keysym_hash (const char *name);
+
+uint32_t keysym_slot (uint64_t h, uint32_t d);
+
+int compare_size (const void *a, const void *b);
+
+int compare_value (const void *a, const void *b);
+
+void print_table (const Name_t *names, int n, const uint16_t *displace,
+        int n_buckets, const int *slots);
+
+void print_page (const char *name, const uint16_t *page);
+
+/************************************************************************
+ * Main function
+ ***********************************************************************/
+int main (int argc, char **argv)
+{
+    Name_t *names = NULL;
+    Bucket_t *buckets;
+    uint16_t *displace;
+    int *slots;
+    char *taken;
+    int n = 0, cap = 0, n_buckets, i, j, b;
+    uint32_t d;
+
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: %s keysymdef.h [more keysym headers]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!read_header (argv[i], &names, &n, &cap))
+            return EXIT_FAILURE;
+    }
+    if (n == 0 || n > 0xffff)
+    {
+        fprintf (stderr, "%d key names, expected 1 to 65535\n", n);
+        return EXIT_FAILURE;
+    }
+
+    n_buckets = (n + BUCKET_LOAD - 1) / BUCKET_LOAD;
+    buckets = calloc (n_buckets, sizeof (Bucket_t));
+    for (b = 0; b < n_buckets; b++)
+    {
+        buckets[b].index = b;
+        buckets[b].names = malloc (n * sizeof (int));
+    }
+    for (i = 0; i < n; i++)
+    {
+        names[i].hash = keysym_hash (names[i].name);
+        b = (names[i].hash >> 32) % n_buckets;
+        buckets[b].names[buckets[b].n++] = i;
+    }
+
+    /* Place the largest buckets first, while most slots are free */
+    qsort (buckets, n_buckets, sizeof (Bucket_t), compare_size);
+
+    displace = calloc (n_buckets, sizeof (uint16_t));
+    slots = malloc (n * sizeof (int));
+    taken = calloc (n, 1);
+    for (b = 0; b < n_buckets && buckets[b].n > 0; b++)
+    {
+        Bucket_t *bucket = &buckets[b];
+
+        for (d = 1; d <= 0xffff; d++)
+        {
+            for (i = 0; i < bucket->n; i++)
+            {
+                int slot = keysym_slot (names[bucket->names[i]].hash, d) % n;
+
+                for (j = 0; j < i; j++)
+                {
+                    if (slots[bucket->names[j]] == slot)
+                        break;
+                }
+                if (taken[slot] || j < i)
+                    break;
+                slots[bucket->names[i]] = slot;
+            }
+            if (i == bucket->n)
+                break;
+        }
+        if (d > 0xffff)
+        {
+            fprintf (stderr, "No displacement for bucket %d\n", bucket->index);
+            return EXIT_FAILURE;
+        }
+
+        displace[bucket->index] = d;
+        for (i = 0; i < bucket->n; i++)
+            taken[slots[bucket->names[i]]] = 1;
+    }
+
+    print_table (names, n, displace, n_buckets, slots);
+
+    return EXIT_SUCCESS;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+int read_header (const char *path, Name_t **names, int *n, int *cap)
+{
+    char line[512], name[256], value[64], *xk;
+    unsigned long v;
+    FILE *f = fopen (path, "r");
+    int i;
+
+    if (f == NULL)
+    {
+        perror (path);
+        return 0;
+    }
+
+    while (fgets (line, sizeof (line), f) != NULL)
+    {
+        if (sscanf (line, "#define %255s %63s", name, value) != 2
+                || (xk = strstr (name, "XK_")) == NULL)
+            continue;
+
+        if (sscanf (value, "_EVDEVK(%lx)", &v) == 1)
+            v += 0x10081000;
+        else if (sscanf (value, "0x%lx", &v) != 1)
+            continue;
+
+        /* XF86XK_AudioPlay is XF86AudioPlay */
+        memmove (xk, xk + 3, strlen (xk + 3) + 1);
+
+        for (i = 0; i < *n && strcmp ((*names)[i].name, name) != 0; i++)
+            ;
+        if (i < *n)
+            continue;
+
+        if (*n == *cap)
+        {
+            *cap = *cap ? *cap * 2 : 4096;
+            *names = realloc (*names, *cap * sizeof (Name_t));
+        }
+        (*names)[*n].name = strdup (name);
+        (*names)[*n].value = v;
+        (*names)[*n].order = *n;
+        (*n)++;
+    }
+    fclose (f);
+
+    return 1;
+}
+
+/* keysym_hash () and keysym_slot () must be the same as in keysym.c */
+uint64_t keysym_hash (const char *name)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 1099511628211ull;
+
+    return h;
+}
+
+/* Slot of a name with hash h in a bucket with displacement d */
+uint32_t keysym_slot (uint64_t h, uint32_t d)
+{
+    uint32_t x = (uint32_t)h ^ (d * 0x9e3779b9u);
+
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+
+    return x;
+}
+
+int compare_size (const void *a, const void *b)
+{
+    return ((const Bucket_t *)b)->n - ((const Bucket_t *)a)->n;
+}
+
+/* By value, and for equal values the name first in the headers first */
+int compare_value (const void *a, const void *b)
+{
+    const Name_t *x = a, *y = b;
+
+    if (x->value != y->value)
+        return x->value < y->value ? -1 : 1;
+    return x->order - y->order;
+}
+
+void print_table (const Name_t *names, int n, const uint16_t *displace,
+        int n_buckets, const int *slots)
+{
+    Name_t *by_value = malloc (n * sizeof (Name_t));
+    int *at_slot = malloc (n * sizeof (int));
+    int *offset = malloc (n * sizeof (int));
+    uint16_t latin1[256], function[256];
+    int i, pool = 0, n_values = 0;
+
+    for (i = 0; i < n; i++)
+        at_slot[slots[i]] = i;
+
+    printf ("/* Generated by gen-keysyms, do not edit */\n\n"
+            "#include <stdint.h>\n\n");
+    printf ("#define KEYSYM_NAMES %d\n#define KEYSYM_BUCKETS %d\n\n",
+            n, n_buckets);
+
+    printf ("static const char keysym_pool[] =");
+    for (i = 0; i < n; i++)
+    {
+        offset[at_slot[i]] = pool;
+        pool += strlen (names[at_slot[i]].name) + 1;
+        printf ("\n    \"%s\\0\"", names[at_slot[i]].name);
+    }
+    printf (";\n\n");
+    if (pool > 0xffff)
+    {
+        fprintf (stderr, "%d bytes of key names, expected at most 65535\n",
+                pool);
+        exit (EXIT_FAILURE);
+    }
+
+    printf ("/* Per slot */\nstatic const uint16_t keysym_offset[] =\n{");
+    for (i = 0; i < n; i++)
+        printf ("%s%d,", i % 12 ? " " : "\n    ", offset[at_slot[i]]);
+    printf ("\n};\n\n");
+
+    printf ("static const uint32_t keysym_value[] =\n{");
+    for (i = 0; i < n; i++)
+        printf ("%s0x%x,", i % 6 ? " " : "\n    ", names[at_slot[i]].value);
+    printf ("\n};\n\n");
+
+    printf ("/* Per bucket, seeds the second hash */\n"
+            "static const uint16_t keysym_displace[] =\n{");
+    for (i = 0; i < n_buckets; i++)
+        printf ("%s%d,", i % 12 ? " " : "\n    ", displace[i]);
+    printf ("\n};\n\n");
+
+    /* Slots by value, only the first name of every value */
+    memcpy (by_value, names, n * sizeof (Name_t));
+    qsort (by_value, n, sizeof (Name_t), compare_value);
+    printf ("/* Slots sorted by value, the first name of each */\n"
+            "static const uint16_t keysym_by_value[] =\n{");
+    for (i = 0; i < n; i++)
+    {
+        if (i > 0 && by_value[i].value == by_value[i - 1].value)
+            continue;
+        printf ("%s%d,", n_values++ % 12 ? " " : "\n    ",
+                slots[by_value[i].order]);
+    }
+    printf ("\n};\n\n#define KEYSYM_VALUES %d\n\n", n_values);
+
+    /* Slot + 1 of the first name of 0x00..0xff and of 0xff00..0xffff */
+    memset (latin1, 0, sizeof (latin1));
+    memset (function, 0, sizeof (function));
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (names[i].value < 0x100)
+            latin1[names[i].value] = slots[i] + 1;
+        else if ((names[i].value & ~0xffu) == 0xff00)
+            function[names[i].value & 0xff] = slots[i] + 1;
+    }
+    print_page ("keysym_latin1", latin1);
+    print_page ("keysym_function", function);
+
+    free (by_value);
+    free (at_slot);
+    free (offset);
+}
+
+void print_page (const char *name, const uint16_t *page)
+{
+    int i;
+
+    printf ("static const uint16_t %s[256] =\n{", name);
+    for (i = 0; i < 256; i++)
+        printf ("%s%d,", i % 12 ? " " : "\n    ", page[i]);
+    printf ("\n};\n\n");
+}
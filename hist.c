@@ -0,0 +1,93 @@
+/************************************************************************
+ * hist.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include "hist.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+int bucket_of (uint64_t value);
+
+uint64_t bucket_upper (int bucket);
+
+/************************************************************************
+ * Histogram interface
+ ***********************************************************************/
+void hist_record (Histogram_t *hist, uint64_t value)
+{
+    hist->buckets[bucket_of (value)]++;
+    hist->count++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+uint64_t hist_quantile (const Histogram_t *hist, double quantile)
+{
+    uint64_t rank = quantile * hist->count, seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += hist->buckets[b];
+        if (seen > rank)
+            return bucket_upper (b) < hist->max ? bucket_upper (b) : hist->max;
+    }
+
+    return hist->max;
+}
+
+/* One line of microseconds per histogram */
+void hist_print (const Histogram_t *hist, FILE *f)
+{
+    fprintf (f, "%-10s count %llu  p50 %.1f  p90 %.1f  p99 %.1f  "
+            "p999 %.1f  max %.1f us\n", hist->name,
+            (unsigned long long)hist->count,
+            hist_quantile (hist, 0.5) / 1e3,
+            hist_quantile (hist, 0.9) / 1e3,
+            hist_quantile (hist, 0.99) / 1e3,
+            hist_quantile (hist, 0.999) / 1e3,
+            hist->max / 1e3);
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+int bucket_of (uint64_t value)
+{
+    int e;
+
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    e = 63 - __builtin_clzll (value);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS
+        + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+uint64_t bucket_upper (int bucket)
+{
+    int e = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+
+    return ((HIST_SUB_BUCKETS + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
@@ -0,0 +1,60 @@
+/************************************************************************
+ * hist.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Fixed-size log-linear histograms of nanosecond values. Every power of
+ * two is split into HIST_SUB_BUCKETS, so a recorded value is off by at
+ * most 1/HIST_SUB_BUCKETS. Recording is a few instructions and never
+ * allocates.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _Histogram_t
+{
+    const char *name;
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram_t;
+
+/************************************************************************
+ * Histogram interface
+ ***********************************************************************/
+void hist_record (Histogram_t *hist, uint64_t value);
+
+/* Upper bound of the bucket holding the given quantile (0..1) */
+uint64_t hist_quantile (const Histogram_t *hist, double quantile);
+
+void hist_print (const Histogram_t *hist, FILE *f);
+
+#endif /* HIST_H */
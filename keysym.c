@@ -0,0 +1,160 @@
+/************************************************************************
+ * keysym.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "keysym.h"
+#include "keysym-table.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+uint64_t keysym_hash (const char *name);
+
+uint32_t keysym_slot (uint64_t h, uint32_t d);
+
+/************************************************************************
+ * Keysym interface
+ ***********************************************************************/
+/*
+ * Like XStringToKeysym: a name from the keysym headers, U followed by
+ * the hex code point of a Unicode character, or a hex keysym 0x...
+ */
+KeySym keysym_lookup (const char *name)
+{
+    uint64_t h = keysym_hash (name);
+    uint32_t slot;
+    unsigned long val;
+    const char *c;
+    char *end;
+
+    slot = keysym_slot (h, keysym_displace[(h >> 32) % KEYSYM_BUCKETS])
+        % KEYSYM_NAMES;
+    if (strcmp (keysym_pool + keysym_offset[slot], name) == 0)
+        return keysym_value[slot];
+
+    if (name[0] == 'U' && name[1] != '\0')
+    {
+        val = 0;
+        for (c = name + 1; *c != '\0'; c++)
+        {
+            if (*c >= '0' && *c <= '9')
+                val = (val << 4) + *c - '0';
+            else if (*c >= 'a' && *c <= 'f')
+                val = (val << 4) + *c - 'a' + 10;
+            else if (*c >= 'A' && *c <= 'F')
+                val = (val << 4) + *c - 'A' + 10;
+            else
+                return NoSymbol;
+            if (val > 0x10ffff)
+                return NoSymbol;
+        }
+        if (val < 0x20 || (val > 0x7e && val < 0xa0))
+            return NoSymbol;
+        if (val < 0x100)
+            return val;
+        return val | 0x01000000;
+    }
+
+    if (name[0] == '0' && (name[1] == 'x' || name[1] == 'X')
+            && name[2] != '\0')
+    {
+        val = strtoul (name, &end, 16);
+        if (*end != '\0' || val > 0x1fffffff)
+            return NoSymbol;
+        return val;
+    }
+
+    return NoSymbol;
+}
+
+/*
+ * Like XKeysymToString: the first name of ks in the keysym headers, or
+ * its U name if it is a Unicode keysym without one. Unlike it, never
+ * NULL: other keysyms get the 0x form keysym_lookup () reads back. The
+ * last two are only good until the next call from the same thread.
+ */
+const char *keysym_name (KeySym ks)
+{
+    static __thread char buf[16];
+    int lo = 0, hi = KEYSYM_VALUES - 1, mid;
+    uint32_t val;
+
+    /* Latin-1 and the function keys directly, the rest by bisection */
+    if (ks < 0x100 && keysym_latin1[ks] != 0)
+        return keysym_pool + keysym_offset[keysym_latin1[ks] - 1];
+    if ((ks & ~0xffUL) == 0xff00 && keysym_function[ks & 0xff] != 0)
+        return keysym_pool + keysym_offset[keysym_function[ks & 0xff] - 1];
+
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        val = keysym_value[keysym_by_value[mid]];
+        if (val == ks)
+            return keysym_pool + keysym_offset[keysym_by_value[mid]];
+        if (val < ks)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    /* Below U+0100 the Unicode keysyms are not Xlib's, which names them
+     * in hex; above U+FFFF XKeysymToString () prints eight digits */
+    if (ks >= 0x1000100 && ks <= 0x110ffff)
+    {
+        ks &= 0xffffff;
+        snprintf (buf, sizeof (buf), ks > 0xffff ? "U%08lX" : "U%04lX", ks);
+        return buf;
+    }
+
+    snprintf (buf, sizeof (buf), "0x%lx", ks);
+    return buf;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/* keysym_hash () and keysym_slot () must be the same as in gen-keysyms.c */
+uint64_t keysym_hash (const char *name)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 1099511628211ull;
+
+    return h;
+}
+
+/* Slot of a name with hash h in a bucket with displacement d */
+uint32_t keysym_slot (uint64_t h, uint32_t d)
+{
+    uint32_t x = (uint32_t)h ^ (d * 0x9e3779b9u);
+
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+
+    return x;
+}
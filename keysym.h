@@ -0,0 +1,41 @@
+/************************************************************************
+ * keysym.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Key names and keysyms without Xlib: XStringToKeysym() and
+ * XKeysymToString() over tables that gen-keysyms builds from the
+ * installed keysymdef.h and vendor keysym headers (keysym-table.h).
+ * Neither needs a display, the locale or any state set up first.
+ */
+
+#ifndef KEYSYM_H
+#define KEYSYM_H
+
+#include <X11/X.h>
+
+
+/************************************************************************
+ * Keysym interface
+ ***********************************************************************/
+KeySym keysym_lookup (const char *name);
+
+const char *keysym_name (KeySym ks);
+
+#endif /* KEYSYM_H */
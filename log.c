@@ -0,0 +1,233 @@
+/************************************************************************
+ * log.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <X11/Xlib.h>
+
+#include "log.h"
+#include "engine.h"
+#include "keysym.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void *log_writer (void *arg);
+
+void log_wake (Log_t *log);
+
+Bool log_drain (Log_t *log, uint64_t *reported);
+
+void log_format (FILE *out, const LogRecord_t *r);
+
+/************************************************************************
+ * Log interface
+ ***********************************************************************/
+Bool log_start (Log_t *log, FILE *out)
+{
+    log->head = log->tail = log->dropped = 0;
+    log->out = out;
+    log->direct = False;
+    __atomic_store_n (&log->running, 1, __ATOMIC_RELEASE);
+
+    log->wake_fd = eventfd (0, EFD_CLOEXEC);
+    if (log->wake_fd < 0
+            || pthread_create (&log->writer, NULL, log_writer, log) != 0)
+    {
+        perror ("Failed to start log writer");
+        if (log->wake_fd >= 0)
+            close (log->wake_fd);
+        log->wake_fd = -1;
+        log->running = 0;
+        log->out = NULL;
+        return False;
+    }
+
+    return True;
+}
+
+void log_direct (Log_t *log, FILE *out)
+{
+    log->head = log->tail = log->dropped = 0;
+    log->out = out;
+    log->direct = True;
+    log->wake_fd = -1;
+    log->running = 0;
+}
+
+void log_stop (Log_t *log)
+{
+    if (log->out == NULL)
+        return;
+
+    if (log->direct)
+    {
+        fflush (log->out);
+        log->out = NULL;
+        return;
+    }
+
+    __atomic_store_n (&log->running, 0, __ATOMIC_RELEASE);
+    log_wake (log);
+    pthread_join (log->writer, NULL);
+    close (log->wake_fd);
+    log->out = NULL;
+}
+
+void log_put (Log_t *log, LogKind_t kind, uint32_t a, uint32_t b,
+        uint64_t c)
+{
+    uint64_t head = log->head;
+    LogRecord_t *r;
+
+    if (log->direct)
+    {
+        LogRecord_t record = {kind, a, b, c};
+
+        log_format (log->out, &record);
+        fflush (log->out);
+        return;
+    }
+
+    if (head - __atomic_load_n (&log->tail, __ATOMIC_ACQUIRE) >= LOG_RING)
+    {
+        __atomic_store_n (&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    r = &log->ring[head & (LOG_RING - 1)];
+    r->kind = kind;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+
+    __atomic_store_n (&log->head, head + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in log_writer (): either the writer sees
+     * this record before sleeping, or this sees the ring was empty */
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&log->tail, __ATOMIC_RELAXED) == head)
+        log_wake (log);
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void *log_writer (void *arg)
+{
+    Log_t *log = arg;
+    uint64_t reported = 0, count;
+
+    while (__atomic_load_n (&log->running, __ATOMIC_ACQUIRE))
+    {
+        /* Sleep only once the ring is seen empty after the last tail */
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (log_drain (log, &reported))
+            continue;
+
+        if (read (log->wake_fd, &count, sizeof (count)) < 0
+                && errno != EINTR)
+            perror ("Log writer");
+    }
+    log_drain (log, &reported);
+
+    return NULL;
+}
+
+void log_wake (Log_t *log)
+{
+    uint64_t one = 1;
+
+    if (write (log->wake_fd, &one, sizeof (one)) < 0)
+        __atomic_store_n (&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+}
+
+/* Returns False if there was nothing to write */
+Bool log_drain (Log_t *log, uint64_t *reported)
+{
+    uint64_t head = __atomic_load_n (&log->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = log->tail;
+    uint64_t dropped;
+
+    if (head == tail)
+        return False;
+
+    for (; tail != head; tail++)
+    {
+        log_format (log->out, &log->ring[tail & (LOG_RING - 1)]);
+        __atomic_store_n (&log->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_load_n (&log->dropped, __ATOMIC_RELAXED);
+    if (dropped != *reported)
+    {
+        fprintf (log->out, "Dropped %lu log records, %lu in total\n",
+                (unsigned long)(dropped - *reported),
+                (unsigned long)dropped);
+        *reported = dropped;
+    }
+    fflush (log->out);
+
+    return True;
+}
+
+void log_format (FILE *out, const LogRecord_t *r)
+{
+    switch (r->kind)
+    {
+    case LOG_DECISION:
+        if (r->c == DECISION_SUPPRESSED)
+        {
+            fprintf (out, "Ignoring generated event.\n");
+            break;
+        }
+        fprintf (out, "Intercepted key event %u, key code %u\n", r->a, r->b);
+        if (r->c == DECISION_PRESSED)
+            fprintf (out, "Key pressed!\n");
+        else if (r->c != DECISION_NONE || r->a == KeyRelease)
+            fprintf (out, "Key released!\n");
+        break;
+    case LOG_EXPIRED:
+        fprintf (out, "Dropped stale generated events, %lu in total\n",
+                (unsigned long)r->c);
+        break;
+    case LOG_GENERATE:
+        fprintf (out, "Generating %s!\n", keysym_name (r->c));
+        break;
+    case LOG_GROUP:
+        fprintf (out, "Changed group to %u\n", r->a);
+        break;
+    case LOG_KEYMAP:
+        fprintf (out, "Keymap changed for key codes %u-%u\n",
+                r->a, r->a + r->b - 1);
+        break;
+    case LOG_SIGNAL:
+        fprintf (out, "Caught signal %u!\n", r->a);
+        break;
+    case LOG_RELOAD:
+        fprintf (out, "Reloaded mapping, %u mappings\n", r->a);
+        break;
+    case LOG_STARTUP:
+        fprintf (out, "Startup: %-10s %8u us, %8u us in total\n",
+                (const char *)(uintptr_t)r->c, r->a, r->b);
+        break;
+    }
+}
@@ -0,0 +1,95 @@
+/************************************************************************
+ * log.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Debug log of the event loop. The loop only stores binary records in
+ * a single-producer, single-consumer ring; a writer thread formats and
+ * writes them. When the ring is full records are dropped and counted
+ * rather than making the event loop wait. The writer sleeps on an
+ * eventfd that the loop signals only for a record put into an empty
+ * ring, so an idle xcape does not wake up for logging.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <X11/Xlib.h>
+
+
+/* Records in the ring, a power of two */
+#define LOG_RING 4096
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef enum _LogKind_t
+{
+    LOG_DECISION,           /* a: event, b: key code, c: Decision_t */
+    LOG_EXPIRED,            /* c: stale generated events in total */
+    LOG_GENERATE,           /* a: key code, c: its KeySym */
+    LOG_GROUP,              /* a: locked group */
+    LOG_KEYMAP,             /* a: first key code, b: count */
+    LOG_SIGNAL,             /* a: signal number */
+    LOG_RELOAD,             /* a: mappings now in use */
+    LOG_STARTUP             /* a: us since the last point, b: us since
+                             * main (), c: the point's static name */
+} LogKind_t;
+
+typedef struct _LogRecord_t
+{
+    uint32_t kind;          /* LogKind_t */
+    uint32_t a;
+    uint32_t b;
+    uint64_t c;
+} LogRecord_t;
+
+typedef struct _Log_t
+{
+    LogRecord_t ring[LOG_RING];
+    uint64_t head;          /* written by the event loop only */
+    uint64_t tail;          /* written by the writer only */
+    uint64_t dropped;       /* written by the event loop only */
+    FILE *out;
+    pthread_t writer;
+    int wake_fd;            /* eventfd the writer sleeps on */
+    int running;
+    Bool direct;            /* no writer, log_put () writes out itself */
+} Log_t;
+
+/************************************************************************
+ * Log interface
+ ***********************************************************************/
+/* Returns False if the writer could not be started, see log_direct () */
+Bool log_start (Log_t *log, FILE *out);
+
+/* Without a writer: log_put () formats and writes each record at once */
+void log_direct (Log_t *log, FILE *out);
+
+/* Writes out what is left and stops the writer */
+void log_stop (Log_t *log);
+
+/* Never blocks, drops the record if the writer is behind */
+void log_put (Log_t *log, LogKind_t kind, uint32_t a, uint32_t b,
+        uint64_t c);
+
+#endif /* LOG_H */
@@ -0,0 +1,445 @@
+/************************************************************************
+ * pool.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "xcape.h"
+
+/* Ready sessions handled per wakeup of a worker */
+#define WORKER_EVENTS 16
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void *worker_run (void *arg);
+
+Bool worker_reap (Worker_t *w);
+
+void worker_wake (Worker_t *w);
+
+Session_t *session_open (XCape_t *self, const char *display);
+
+void session_free (Session_t *session);
+
+Bool share_mapping (XCape_t *self, Session_t *session);
+
+Bool load_copy (Engine_t *engine, const char *mapping);
+
+/************************************************************************
+ * Pool interface
+ ***********************************************************************/
+/* Start n_workers threads, the pool keeps mapping and frees it */
+Bool pool_start (XCape_t *self, int n_workers, char *mapping,
+        const char *cache_path)
+{
+    Pool_t *pool = &self->pool;
+    struct epoll_event ev;
+    int i;
+
+    /* Displays are opened here and used by the workers */
+    XInitThreads ();
+
+    pthread_mutex_init (&pool->lock, NULL);
+    pool->mapping = mapping;
+    pool->source_fp = cache_source_fingerprint (mapping);
+    pool->cache_path = cache_path;
+    pool->starting = 1;
+
+    for (i = 0; i < n_workers; i++)
+    {
+        Worker_t *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        w->wake_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (w->epoll_fd < 0 || w->wake_fd < 0
+                || epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) < 0)
+        {
+            perror ("Failed to set up worker");
+            return False;
+        }
+        if (self->debug)
+        {
+            FILE *out = self->log_out ? self->log_out : stdout;
+
+            w->log = malloc (sizeof (Log_t));
+            if (w->log == NULL)
+            {
+                perror ("Failed to set up worker log");
+                return False;
+            }
+            if (!log_start (w->log, out))
+                log_direct (w->log, out);
+        }
+
+        if (pthread_create (&w->thread, NULL, worker_run, w) != 0)
+        {
+            perror ("Failed to start worker");
+            return False;
+        }
+        pool->n_workers++;
+    }
+
+    return True;
+}
+
+/* Connect to display and hand it to the worker with the fewest */
+Bool pool_add (XCape_t *self, const char *display)
+{
+    Pool_t *pool = &self->pool;
+    Worker_t *w = &pool->workers[0];
+    struct epoll_event ev;
+    Session_t *s;
+    int i;
+
+    pthread_mutex_lock (&pool->lock);
+    for (s = pool->sessions; s != NULL; s = s->next)
+    {
+        if (strcmp (s->display, display) == 0)
+            break;
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    if (s != NULL)
+    {
+        fprintf (stderr, "Already serving display %s\n", display);
+        return False;
+    }
+
+    s = session_open (self, display);
+    if (s == NULL)
+        return False;
+
+    pthread_mutex_lock (&pool->lock);
+    for (i = 1; i < pool->n_workers; i++)
+    {
+        if (pool->workers[i].n_sessions < w->n_sessions)
+            w = &pool->workers[i];
+    }
+    w->n_sessions++;
+    s->worker = w;
+    s->log = w->log;
+    s->debug = self->debug;
+    if (pool->starting > 0 && s->startup[STARTUP_READY] == 0)
+    {
+        s->starting = True;
+        pool->starting++;
+    }
+    s->next = pool->sessions;
+    pool->sessions = s;
+    pthread_mutex_unlock (&pool->lock);
+
+    /* From here on only the worker touches the session */
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, s->epoll_fd, &ev) < 0)
+    {
+        perror ("epoll_ctl");
+        pool_remove (self, display);
+        return False;
+    }
+
+    return True;
+}
+
+/* The worker of display closes it before it handles anything else */
+Bool pool_remove (XCape_t *self, const char *display)
+{
+    Pool_t *pool = &self->pool;
+    Session_t *s;
+
+    pthread_mutex_lock (&pool->lock);
+    for (s = pool->sessions; s != NULL; s = s->next)
+    {
+        if (!s->closing && strcmp (s->display, display) == 0)
+        {
+            s->closing = True;
+            worker_wake (s->worker);
+            break;
+        }
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return s != NULL;
+}
+
+void pool_foreach (XCape_t *self,
+        void (*fn) (Session_t *session, FILE *out), FILE *out)
+{
+    Pool_t *pool = &self->pool;
+    Session_t *s;
+
+    pthread_mutex_lock (&pool->lock);
+    for (s = pool->sessions; s != NULL; s = s->next)
+        fn (s, out);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+Bool pool_ready (XCape_t *self, Session_t *session)
+{
+    Pool_t *pool = &self->pool;
+    Bool last = False;
+
+    pthread_mutex_lock (&pool->lock);
+    if (session == NULL || session->starting)
+    {
+        if (session != NULL)
+            session->starting = False;
+        last = --pool->starting == 0;
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return last;
+}
+
+void pool_stop (XCape_t *self)
+{
+    Pool_t *pool = &self->pool;
+    int i;
+
+    for (i = 0; i < pool->n_workers; i++)
+    {
+        pthread_mutex_lock (&pool->lock);
+        pool->workers[i].stop = True;
+        worker_wake (&pool->workers[i]);
+        pthread_mutex_unlock (&pool->lock);
+    }
+
+    for (i = 0; i < pool->n_workers; i++)
+    {
+        pthread_join (pool->workers[i].thread, NULL);
+        close (pool->workers[i].epoll_fd);
+        close (pool->workers[i].wake_fd);
+        if (pool->workers[i].log != NULL)
+        {
+            log_stop (pool->workers[i].log);
+            free (pool->workers[i].log);
+        }
+    }
+
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->mapping);
+    memset (pool, 0, sizeof (Pool_t));
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void *worker_run (void *arg)
+{
+    Worker_t *w = (Worker_t *)arg;
+    struct epoll_event events[WORKER_EVENTS];
+    uint64_t count;
+    Session_t *s;
+    Bool reap;
+    int i, n;
+
+    for (;;)
+    {
+        n = epoll_wait (w->epoll_fd, events, WORKER_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror ("epoll_wait");
+            return NULL;
+        }
+
+        reap = False;
+        for (i = 0; i < n; i++)
+        {
+            s = (Session_t *)events[i].data.ptr;
+            if (s == NULL)
+            {
+                if (read (w->wake_fd, &count, sizeof (count)) > 0)
+                    reap = True;
+                continue;
+            }
+
+            session_dispatch (s);
+            if (s->lost)
+                reap = True;
+        }
+
+        if (reap && worker_reap (w))
+            return NULL;
+    }
+}
+
+/*
+ * Close the sessions of w that are lost or to be removed, or all of
+ * them if w is to stop. Returns True in the latter case.
+ */
+Bool worker_reap (Worker_t *w)
+{
+    Pool_t *pool = w->pool;
+    Session_t **p, *s, *dead = NULL;
+    Bool stop;
+
+    pthread_mutex_lock (&pool->lock);
+    stop = w->stop;
+    for (p = &pool->sessions; (s = *p) != NULL; )
+    {
+        if (s->worker == w && (stop || s->closing || s->lost))
+        {
+            *p = s->next;
+            s->next = dead;
+            dead = s;
+            w->n_sessions--;
+        }
+        else
+        {
+            p = &s->next;
+        }
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    while ((s = dead) != NULL)
+    {
+        dead = s->next;
+        if (s->lost)
+            fprintf (stderr, "Lost the connection to display %s\n",
+                    s->display);
+        epoll_ctl (w->epoll_fd, EPOLL_CTL_DEL, s->epoll_fd, NULL);
+        backend_stop (s);
+
+        /* Readiness does not wait for a display that never recorded */
+        if (!stop && pool_ready (s->xcape, s))
+            notify_ready (s->xcape, s->log);
+        session_free (s);
+    }
+
+    return stop;
+}
+
+/* With the pool locked */
+void worker_wake (Worker_t *w)
+{
+    uint64_t one = 1;
+
+    if (write (w->wake_fd, &one, sizeof (one)) < 0)
+        perror ("Failed to wake worker");
+}
+
+/* A session recording display, not yet handed to a worker */
+Session_t *session_open (XCape_t *self, const char *display)
+{
+    Session_t *s = calloc (1, sizeof (Session_t));
+
+    s->xcape = self;
+    startup_mark (s, STARTUP_MAIN);
+
+    s->display = strdup (display);
+    s->engine.timeout = self->session.engine.timeout;
+    s->engine.debug = self->session.engine.debug;
+    s->hist_intercept.name = self->session.hist_intercept.name;
+    s->hist_lag.name = self->session.hist_lag.name;
+    s->hist_hold.name = self->session.hist_hold.name;
+    s->hist_output.name = self->session.hist_output.name;
+
+    s->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0)
+    {
+        perror ("Failed to set up display");
+        session_free (s);
+        return NULL;
+    }
+
+    if (!backend_open (s) || !share_mapping (self, s))
+    {
+        backend_close (s);
+        session_free (s);
+        return NULL;
+    }
+    startup_mark (s, STARTUP_MAPPING);
+
+    if (!watch_session (s) || !backend_start (s))
+    {
+        backend_close (s);
+        session_free (s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void session_free (Session_t *session)
+{
+    engine_free (&session->engine);
+    if (session->epoll_fd >= 0)
+        close (session->epoll_fd);
+    free ((char *)session->display);
+    free (session);
+}
+
+/*
+ * Sessions with the keymap the mapping was loaded for share it, the
+ * first session decides which keymap that is. Others parse their own.
+ */
+Bool share_mapping (XCape_t *self, Session_t *session)
+{
+    Engine_t *engine = &self->session.engine;
+    Pool_t *pool = &self->pool;
+    uint64_t keymap_fp = cache_keymap_fingerprint (&session->engine.keymap);
+
+    if (engine->map == NULL)
+    {
+        engine->keymap = session->engine.keymap;
+        if ((pool->cache_path == NULL || !cache_load (pool->cache_path,
+                        engine, pool->source_fp))
+                && !load_copy (engine, pool->mapping))
+        {
+            fprintf (stderr, "Failed to parse_mapping\n");
+            return False;
+        }
+        pool->keymap_fp = keymap_fp;
+    }
+
+    if (keymap_fp == pool->keymap_fp)
+        return engine_share (&session->engine, engine);
+
+    if (!load_copy (&session->engine, pool->mapping))
+    {
+        fprintf (stderr, "Failed to parse_mapping for display %s\n",
+                session->display);
+        return False;
+    }
+
+    return True;
+}
+
+/* engine_load () takes the mapping apart */
+Bool load_copy (Engine_t *engine, const char *mapping)
+{
+    char *copy = strdup (mapping);
+    Bool ok = copy != NULL && engine_load (engine, copy);
+
+    free (copy);
+    return ok;
+}
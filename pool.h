@@ -0,0 +1,100 @@
+/************************************************************************
+ * pool.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * One xcape for many displays, 'xcape --displays LIST'. Every display
+ * is a session of its own, a Session_t with its connections, record
+ * context and key state, served by one of a few worker threads.
+ * Sessions whose keymap is the one the mapping was loaded for use the
+ * mapping of the main XCape_t without a copy, see engine_share ().
+ *
+ * The main thread opens sessions and serves signals and the control
+ * socket; a session is only ever handled and closed by its worker,
+ * which also has the debug log of its sessions.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <X11/Xlib.h>
+
+/* Most worker threads, and how many --workers defaults to at most */
+#define POOL_WORKERS 16
+#define POOL_DEFAULT_WORKERS 4
+
+struct _XCape_t;
+struct _Session_t;
+struct _Pool_t;
+struct _Log_t;
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _Worker_t
+{
+    pthread_t thread;
+    int epoll_fd;               /* the epoll_fd of each of its sessions */
+    int wake_fd;                /* eventfd, written to close sessions */
+    int n_sessions;
+    Bool stop;
+    struct _Log_t *log;         /* of its sessions, NULL without -d */
+    struct _Pool_t *pool;
+} Worker_t;
+
+typedef struct _Pool_t
+{
+    pthread_mutex_t lock;       /* sessions, their closing and stop */
+    struct _Session_t *sessions;    /* linked by Session_t.next */
+    int starting;               /* sessions READY waits for, see pool_ready */
+    Worker_t workers[POOL_WORKERS];
+    int n_workers;              /* 0 without --displays */
+    char *mapping;              /* source, parsed again for other keymaps */
+    uint64_t source_fp;
+    uint64_t keymap_fp;         /* of the keymap the mapping was loaded for */
+    const char *cache_path;     /* --cache, tried for the first keymap */
+} Pool_t;
+
+/************************************************************************
+ * Pool interface
+ ***********************************************************************/
+Bool pool_start (struct _XCape_t *self, int n_workers, char *mapping,
+        const char *cache_path);
+
+Bool pool_add (struct _XCape_t *self, const char *display);
+
+Bool pool_remove (struct _XCape_t *self, const char *display);
+
+/* Calls fn on every session, none is closed meanwhile */
+void pool_foreach (struct _XCape_t *self,
+        void (*fn) (struct _Session_t *session, FILE *out), FILE *out);
+
+/*
+ * Displays added before the first True are waited for. Called for each
+ * of them that records or is closed, and with session NULL once all
+ * were added; True for the last call.
+ */
+Bool pool_ready (struct _XCape_t *self, struct _Session_t *session);
+
+void pool_stop (struct _XCape_t *self);
+
+#endif /* POOL_H */
@@ -0,0 +1,53 @@
+/************************************************************************
+ * probes.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * USDT probes of provider "xcape", for perf, bpftrace and SystemTap. A
+ * disabled probe is a single nop. Without <sys/sdt.h> (the Makefile
+ * defines XCAPE_SDT when it is found) they compile to nothing.
+ *
+ *   event (type, key_code, server_time)     a record event arrived
+ *   match (key_code, mapping)               it is a mapped key
+ *   tap (key_code, mapping, n_keys)         a tap generates keys
+ *   reject (key_code, mapping, reason, ms)  a release generates nothing,
+ *                                           reason is a Decision_t
+ *   suppress (key_code, mapping)            an echo was recognized
+ *   flush (n_keys, ns)                      generated keys were sent, ns
+ *                                           after the event arrived
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef XCAPE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1 (xcape, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2 (xcape, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3 (xcape, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4 (xcape, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,149 @@
+/************************************************************************
+ * stats.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+size_t stats_size (uint32_t n_maps);
+
+void stats_layout (StatsFile_t *stats, void *base, size_t size);
+
+/************************************************************************
+ * Stats interface
+ ***********************************************************************/
+/*
+ * Publish the mappings of engine at path and make the engine count
+ * into the file. Any previous stats of the engine should be closed
+ * after this, not before.
+ */
+Bool stats_create (StatsFile_t *stats, const char *path, Engine_t *engine)
+{
+    size_t size = stats_size (engine->n_maps);
+    char *tmp = malloc (strlen (path) + 5);
+    KeyMap_t *km;
+    void *p;
+    int fd;
+
+    sprintf (tmp, "%s.new", path);
+    fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate (fd, size) < 0)
+    {
+        perror (tmp);
+        if (fd >= 0)
+            close (fd);
+        free (tmp);
+        return False;
+    }
+
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+    {
+        perror (tmp);
+        free (tmp);
+        return False;
+    }
+    ((StatsHeader_t *)p)->n_maps = engine->n_maps;
+    stats_layout (stats, p, size);
+
+    memcpy (stats->header->magic, STATS_MAGIC, 8);
+    stats->header->name_size = STATS_NAME_SIZE;
+    stats->header->pid = getpid ();
+    stats->header->timeout = engine->timeout;
+    for (km = engine->map; km != NULL; km = km->next)
+        engine_mapping_name (km, stats->names[km->index], STATS_NAME_SIZE);
+
+    engine_use_counters (engine, stats->counters);
+
+    /* Readers only ever see a complete file */
+    if (rename (tmp, path) < 0)
+        perror (path);
+    free (tmp);
+
+    return True;
+}
+
+Bool stats_open (StatsFile_t *stats, const char *path)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    void *p;
+
+    memset (stats, 0, sizeof (StatsFile_t));
+
+    if (fd < 0 || fstat (fd, &st) < 0)
+    {
+        perror (path);
+        if (fd >= 0)
+            close (fd);
+        return False;
+    }
+
+    p = st.st_size >= sizeof (StatsHeader_t)
+        ? mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close (fd);
+    if (p == MAP_FAILED
+            || memcmp (((StatsHeader_t *)p)->magic, STATS_MAGIC, 8) != 0
+            || ((StatsHeader_t *)p)->name_size != STATS_NAME_SIZE
+            || stats_size (((StatsHeader_t *)p)->n_maps) > st.st_size)
+    {
+        fprintf (stderr, "Not an xcape stats file: %s\n", path);
+        if (p != MAP_FAILED)
+            munmap (p, st.st_size);
+        return False;
+    }
+    stats_layout (stats, p, st.st_size);
+
+    return True;
+}
+
+void stats_close (StatsFile_t *stats)
+{
+    if (stats->header != NULL)
+        munmap (stats->header, stats->size);
+    memset (stats, 0, sizeof (StatsFile_t));
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+size_t stats_size (uint32_t n_maps)
+{
+    return sizeof (StatsHeader_t)
+        + n_maps * (STATS_NAME_SIZE + sizeof (MapCounters_t));
+}
+
+void stats_layout (StatsFile_t *stats, void *base, size_t size)
+{
+    stats->header = base;
+    stats->names = (void *)(stats->header + 1);
+    stats->counters = (MapCounters_t *)(stats->names + stats->header->n_maps);
+    stats->size = size;
+}
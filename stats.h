@@ -0,0 +1,69 @@
+/************************************************************************
+ * stats.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Per-mapping counters published by 'xcape --stats FILE'. The engine
+ * counts straight into a shared mapping of the file, readers such as
+ * xcape-stat map it read-only. A new file is renamed into place
+ * whenever the set of mappings changes.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+#define STATS_MAGIC "XCSTAT01"
+#define STATS_NAME_SIZE 64
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+/* Followed by n_maps names and then n_maps MapCounters_t */
+typedef struct _StatsHeader_t
+{
+    char magic[8];
+    uint32_t n_maps;
+    uint32_t name_size;         /* STATS_NAME_SIZE */
+    int32_t pid;
+    uint32_t timeout;           /* -t, in ms */
+} StatsHeader_t;
+
+typedef struct _StatsFile_t
+{
+    StatsHeader_t *header;
+    char (*names)[STATS_NAME_SIZE];
+    MapCounters_t *counters;
+    size_t size;
+} StatsFile_t;
+
+/************************************************************************
+ * Stats interface
+ ***********************************************************************/
+Bool stats_create (StatsFile_t *stats, const char *path, Engine_t *engine);
+
+Bool stats_open (StatsFile_t *stats, const char *path);
+
+void stats_close (StatsFile_t *stats);
+
+#endif /* STATS_H */
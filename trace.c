@@ -0,0 +1,193 @@
+/************************************************************************
+ * trace.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+Bool trace_map (TraceFile_t *trace, int fd, int prot);
+
+Bool trace_valid (const TraceHeader_t *header, size_t size);
+
+/************************************************************************
+ * Trace interface
+ ***********************************************************************/
+/*
+ * Open path for recording, continuing an existing trace if it is one.
+ * Any other file that is not empty is left alone.
+ */
+Bool trace_create (TraceFile_t *trace, const char *path)
+{
+    size_t size = sizeof (TraceHeader_t)
+        + TRACE_RECORDS * sizeof (TraceRecord_t);
+    char magic[8];
+    struct stat st;
+    int fd;
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat (fd, &st) < 0)
+    {
+        perror (path);
+        if (fd >= 0)
+            close (fd);
+        return False;
+    }
+
+    if (st.st_size > 0 && (pread (fd, magic, 8, 0) != 8
+                || memcmp (magic, TRACE_MAGIC, 8) != 0))
+    {
+        fprintf (stderr, "Not an xcape trace, not overwriting: %s\n", path);
+        close (fd);
+        return False;
+    }
+
+    if (st.st_size != size)
+    {
+        if (ftruncate (fd, 0) < 0 || posix_fallocate (fd, 0, size) != 0)
+        {
+            fprintf (stderr, "Failed to allocate trace file %s\n", path);
+            close (fd);
+            return False;
+        }
+    }
+
+    if (!trace_map (trace, fd, PROT_READ | PROT_WRITE))
+    {
+        perror (path);
+        return False;
+    }
+
+    if (!trace_valid (trace->header, trace->size)
+            || trace->header->capacity != TRACE_RECORDS)
+    {
+        memset (trace->header, 0, sizeof (TraceHeader_t));
+        memcpy (trace->header->magic, TRACE_MAGIC, 8);
+        trace->header->record_size = sizeof (TraceRecord_t);
+        trace->header->capacity = TRACE_RECORDS;
+    }
+
+    return True;
+}
+
+/* Open a recorded trace for reading */
+Bool trace_open (TraceFile_t *trace, const char *path)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || !trace_map (trace, fd, PROT_READ))
+    {
+        perror (path);
+        return False;
+    }
+
+    if (!trace_valid (trace->header, trace->size))
+    {
+        fprintf (stderr, "Not an xcape trace: %s\n", path);
+        trace_close (trace);
+        return False;
+    }
+
+    return True;
+}
+
+void trace_close (TraceFile_t *trace)
+{
+    if (trace->header != NULL)
+        munmap (trace->header, trace->size);
+    memset (trace, 0, sizeof (TraceFile_t));
+}
+
+void trace_write (TraceFile_t *trace, int type, KeyCode key_code,
+        Time server_time, uint64_t recv_ns, int decision)
+{
+    TraceHeader_t *h = trace->header;
+    TraceRecord_t *r = &trace->records[h->head % h->capacity];
+
+    r->type = type;
+    r->key_code = key_code;
+    r->decision = decision;
+    r->pad = 0;
+    r->server_time = server_time;
+    r->recv_ns = recv_ns;
+
+    /* Publish the record only once it is complete */
+    __atomic_store_n (&h->head, h->head + 1, __ATOMIC_RELEASE);
+}
+
+const TraceRecord_t *trace_record (const TraceFile_t *trace, uint64_t i)
+{
+    const TraceHeader_t *h = trace->header;
+    uint64_t first = h->head > h->capacity ? h->head - h->capacity : 0;
+
+    return &trace->records[(first + i) % h->capacity];
+}
+
+uint64_t trace_count (const TraceFile_t *trace)
+{
+    const TraceHeader_t *h = trace->header;
+
+    return h->head > h->capacity ? h->capacity : h->head;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/* Maps all of fd and closes it, the mapping stays valid */
+Bool trace_map (TraceFile_t *trace, int fd, int prot)
+{
+    struct stat st;
+    void *p;
+
+    memset (trace, 0, sizeof (TraceFile_t));
+
+    if (fstat (fd, &st) < 0 || st.st_size < sizeof (TraceHeader_t))
+    {
+        close (fd);
+        return False;
+    }
+
+    p = mmap (NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+        return False;
+
+    trace->header = p;
+    trace->records = (TraceRecord_t *)(trace->header + 1);
+    trace->size = st.st_size;
+
+    return True;
+}
+
+Bool trace_valid (const TraceHeader_t *header, size_t size)
+{
+    return memcmp (header->magic, TRACE_MAGIC, 8) == 0
+        && header->record_size == sizeof (TraceRecord_t)
+        && header->capacity > 0
+        && sizeof (TraceHeader_t)
+            + (size_t)header->capacity * sizeof (TraceRecord_t) <= size;
+}
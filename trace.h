@@ -0,0 +1,85 @@
+/************************************************************************
+ * trace.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Event traces written by 'xcape --record-trace FILE' and read by the
+ * replay benchmark. The file is a header followed by a ring of fixed
+ * size records, preallocated and written through a shared mapping so
+ * that recording costs a store per event and no system calls.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+
+#define TRACE_MAGIC "XCTRACE1"
+
+/* Records kept before the oldest are overwritten, 1 MiB of them */
+#define TRACE_RECORDS 65536
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _TraceHeader_t
+{
+    char magic[8];
+    uint32_t record_size;       /* sizeof (TraceRecord_t) */
+    uint32_t capacity;          /* records in the ring */
+    uint64_t head;              /* records ever written */
+} TraceHeader_t;
+
+typedef struct _TraceRecord_t
+{
+    uint8_t type;               /* KeyPress ... ButtonRelease */
+    uint8_t key_code;
+    uint8_t decision;           /* Decision_t */
+    uint8_t pad;
+    uint32_t server_time;       /* ms, from the record stream */
+    uint64_t recv_ns;           /* CLOCK_MONOTONIC when handled */
+} TraceRecord_t;
+
+typedef struct _TraceFile_t
+{
+    TraceHeader_t *header;
+    TraceRecord_t *records;
+    size_t size;                /* of the mapping */
+} TraceFile_t;
+
+/************************************************************************
+ * Trace interface
+ ***********************************************************************/
+Bool trace_create (TraceFile_t *trace, const char *path);
+
+Bool trace_open (TraceFile_t *trace, const char *path);
+
+void trace_close (TraceFile_t *trace);
+
+void trace_write (TraceFile_t *trace, int type, KeyCode key_code,
+        Time server_time, uint64_t recv_ns, int decision);
+
+/* The i:th oldest record still in the ring */
+const TraceRecord_t *trace_record (const TraceFile_t *trace, uint64_t i);
+
+uint64_t trace_count (const TraceFile_t *trace);
+
+#endif /* TRACE_H */
@@ -0,0 +1,148 @@
+/************************************************************************
+ * xcape-stat.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * Prints the per-mapping counters of a running xcape from the file
+ * given to its --stats option. Reading takes nothing from xcape.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+void print_table (const StatsFile_t *stats);
+
+void print_prometheus (const StatsFile_t *stats);
+
+void print_usage (const char *program_name);
+
+/************************************************************************
+ * Main function
+ ***********************************************************************/
+int main (int argc, char **argv)
+{
+    StatsFile_t stats;
+    Bool prometheus = False;
+    int ch, interval = 0;
+
+    while ((ch = getopt (argc, argv, "i:p")) != -1)
+    {
+        switch (ch)
+        {
+        case 'i':
+            interval = atoi (optarg);
+            break;
+        case 'p':
+            prometheus = True;
+            break;
+        default:
+            print_usage (argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        print_usage (argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Open again every time, xcape replaces the file on reload */
+    for (;;)
+    {
+        if (!stats_open (&stats, argv[optind]))
+            return EXIT_FAILURE;
+
+        if (prometheus)
+            print_prometheus (&stats);
+        else
+            print_table (&stats);
+        fflush (stdout);
+
+        stats_close (&stats);
+
+        if (interval <= 0)
+            break;
+        sleep (interval);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+void print_table (const StatsFile_t *stats)
+{
+    const MapCounters_t *c;
+    uint32_t i;
+
+    fprintf (stdout, "%-32s %10s %10s %10s %10s %10s %10s\n", "mapping",
+            "presses", "taps", "used", "mouse", "timeouts", "suppressed");
+
+    for (i = 0; i < stats->header->n_maps; i++)
+    {
+        c = &stats->counters[i];
+        fprintf (stdout, "%-32.*s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+                STATS_NAME_SIZE, stats->names[i],
+                (unsigned long long)c->presses,
+                (unsigned long long)c->taps,
+                (unsigned long long)c->used,
+                (unsigned long long)c->mouse,
+                (unsigned long long)c->timeouts,
+                (unsigned long long)c->suppressed);
+    }
+}
+
+/* Text exposition format, e.g. for the node exporter textfile collector */
+void print_prometheus (const StatsFile_t *stats)
+{
+    static const char *names[] =
+    {
+        "presses", "taps", "used", "mouse", "timeouts", "suppressed"
+    };
+    const uint64_t *c;
+    uint32_t i;
+    int j;
+
+    for (j = 0; j < 6; j++)
+    {
+        fprintf (stdout, "# TYPE xcape_%s_total counter\n", names[j]);
+        for (i = 0; i < stats->header->n_maps; i++)
+        {
+            c = (const uint64_t *)&stats->counters[i];
+            fprintf (stdout, "xcape_%s_total{mapping=\"%.*s\"} %llu\n",
+                    names[j], STATS_NAME_SIZE, stats->names[i],
+                    (unsigned long long)c[j]);
+        }
+    }
+}
+
+void print_usage (const char *program_name)
+{
+    fprintf (stdout, "Usage: %s [-i interval_s] [-p] <stats file>\n",
+            program_name);
+    fprintf (stdout, "-p prints the Prometheus text format\n");
+}
@@ -21,70 +21,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
 #include <signal.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <X11/Xlib.h>
-#include <X11/keysym.h>
-#include <X11/extensions/record.h>
-#include <X11/extensions/XTest.h>
-#include <X11/XKBlib.h>
 
+#include "xcape.h"
+#include "probes.h"
 
 /************************************************************************
- * Internal data types
+ * Internal function declarations
  ***********************************************************************/
-typedef struct _Key_t
-{
-    KeyCode key;
-    struct _Key_t *next;
-} Key_t;
+void event_loop (XCape_t *self);
 
-typedef struct _KeyMap_t
-{
-    Bool UseKeyCode;        /* (for from) instead of KeySym; ignore latter */
-    KeySym from_ks;
-    KeyCode from_kc;
-    Key_t *to_keys;
-    Bool used;
-    Bool pressed;
-    Bool mouse;
-    struct timeval down_at;
-    struct _KeyMap_t *next;
-} KeyMap_t;
-
-typedef struct _XCape_t
-{
-    Display *data_conn;
-    Display *ctrl_conn;
-    XRecordContext record_ctx;
-    pthread_t sigwait_thread;
-    sigset_t sigset;
-    Bool foreground;
-    Bool debug;
-    KeyMap_t *map;
-    Key_t *generated;
-    struct timeval timeout;
-    unsigned char intended_group;
-    unsigned char previous_group;
-} XCape_t;
+Bool handle_fd (Session_t *self, int fd);
 
-/************************************************************************
- * Internal function declarations
- ***********************************************************************/
-void *sig_handler (void *user_data);
+void add_displays (XCape_t *self, const char *list);
+
+void dump_display (Session_t *session, FILE *f);
 
-void intercept (XPointer user_data, XRecordInterceptData *data);
+void record_lag (Session_t *self, Time now, uint64_t recv_ns);
 
-KeyMap_t *parse_mapping (Display *ctrl_conn, char *mapping, Bool debug);
+void write_histograms (XCape_t *self);
 
-void delete_mapping (KeyMap_t *map);
+const char *startup_name (Startup_t point);
 
-Key_t *key_add_key (Key_t *keys, KeyCode key);
+char *read_mapping (XCape_t *self);
 
-void delete_keys (Key_t *keys);
+const char *absolute_path (const char *path);
+
+uint64_t monotonic_ns (void);
 
 void print_usage (const char *program_name);
 
@@ -93,46 +68,143 @@ void print_usage (const char *program_name);
  ***********************************************************************/
 int main (int argc, char **argv)
 {
-    XCape_t *self = malloc (sizeof (XCape_t));
-
-    int dummy, ch;
-
-    static char default_mapping[] = "Control_L=Escape";
-    char *mapping = default_mapping;
-
-    XRecordRange *rec_range = XRecordAllocRange();
-    XRecordClientSpec client_spec = XRecordAllClients;
-    XkbStateRec state;
+    /* First, the time before main () cannot be had from here */
+    uint64_t main_ns = monotonic_ns ();
+    XCape_t *self = calloc (1, sizeof (XCape_t));
+
+    int ch;
+
+    self->session.xcape = self;
+    self->session.log = &self->log;
+    self->session.startup[STARTUP_MAIN] = main_ns;
+
+    char *mapping, *expressions = NULL;
+    const char *trace_path = NULL;
+    const char *control_path = NULL;
+    const char *cache_path = NULL;
+    const char *compile_path = NULL;
+    const char *displays = NULL;
+    long n_workers = 0;
+    uint64_t source_fp;
+
+    static struct option long_options[] =
+    {
+        { "record-trace", required_argument, NULL, 'r' },
+        { "histograms", required_argument, NULL, 'H' },
+        { "stats", required_argument, NULL, 'S' },
+        { "log", required_argument, NULL, 'L' },
+        { "mapping-file", required_argument, NULL, 'm' },
+        { "control", required_argument, NULL, 'c' },
+        { "cache", required_argument, NULL, 'k' },
+        { "compile", required_argument, NULL, 'C' },
+        { "ready-fd", required_argument, NULL, 'R' },
+        { "displays", required_argument, NULL, 'D' },
+        { "workers", required_argument, NULL, 'w' },
+        { "devices", required_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 }
+    };
 
     self->foreground = False;
     self->debug = False;
-    self->timeout.tv_sec = 0;
-    self->timeout.tv_usec = 500000;
-    self->generated = NULL;
+    self->session.engine.timeout = 500;
+    self->mapping = "Control_L=Escape";
+    self->ready_fd = -1;
 
-    rec_range->device_events.first = KeyPress;
-    rec_range->device_events.last = ButtonRelease;
+    self->session.hist_intercept.name = "intercept";
+    self->session.hist_lag.name = "lag";
+    self->session.hist_hold.name = "hold";
+    self->session.hist_output.name = "output";
 
-    while ((ch = getopt (argc, argv, "dfe:t:")) != -1)
+    while ((ch = getopt_long (argc, argv, "dfe:t:",
+                    long_options, NULL)) != -1)
     {
         switch (ch)
         {
         case 'd':
             self->debug = True;
+            self->session.engine.debug = True;
             /* imply -f (no break) */
         case 'f':
             self->foreground = True;
             break;
         case 'e':
-            mapping = optarg;
+            /* Repeated -e add up, each starting in profile default
+             * unless it names another */
+            if (expressions == NULL)
+            {
+                expressions = strdup (optarg);
+            }
+            else
+            {
+                expressions = realloc (expressions, strlen (expressions)
+                        + strlen ("[default]") + strlen (optarg) + 2);
+                strcat (expressions, ";");
+                if (optarg[0] != '[')
+                    strcat (expressions, "[default]");
+                strcat (expressions, optarg);
+            }
+            self->mapping = expressions;
+            break;
+        case 'm':
+            self->mapping_path = optarg;
+            break;
+        case 'c':
+            control_path = optarg;
+            break;
+        case 'k':
+            cache_path = optarg;
+            break;
+        case 'C':
+            compile_path = optarg;
+            break;
+        case 'R':
+            self->ready_fd = atoi (optarg);
+            if (fcntl (self->ready_fd, F_GETFD) < 0)
+            {
+                fprintf (stderr, "Invalid argument for '--ready-fd': %s.\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            displays = optarg;
+            break;
+        case 'w':
+            n_workers = atoi (optarg);
+            if (n_workers < 1 || n_workers > POOL_WORKERS)
+            {
+                fprintf (stderr, "Invalid argument for '--workers': %s.\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+            self->devices = optarg;
+            break;
+        case 'r':
+            trace_path = optarg;
+            break;
+        case 'H':
+            self->hist_path = optarg;
+            break;
+        case 'S':
+            self->stats_path = optarg;
+            break;
+        case 'L':
+            self->log_out = fopen (optarg, "a");
+            if (self->log_out == NULL)
+            {
+                perror (optarg);
+                return EXIT_FAILURE;
+            }
+            self->debug = True;
             break;
         case 't':
             {
                 int ms = atoi (optarg);
                 if (ms > 0)
                 {
-                    self->timeout.tv_sec = ms / 1000;
-                    self->timeout.tv_usec = (ms % 1000) * 1000;
+                    self->session.engine.timeout = ms;
                 }
                 else
                 {
@@ -148,6 +220,8 @@ int main (int argc, char **argv)
         }
     }
 
+    self->session.debug = self->debug;
+
     if (optind < argc)
     {
         fprintf (stderr, "Not a command line option: '%s'\n", argv[optind]);
@@ -155,49 +229,53 @@ int main (int argc, char **argv)
         return EXIT_SUCCESS;
     }
 
-    if (!XInitThreads ())
+    if (displays != NULL && (compile_path != NULL || trace_path != NULL
+                || self->stats_path != NULL))
     {
-        fprintf (stderr, "Failed to initialize threads.\n");
-        exit (EXIT_FAILURE);
+        fprintf (stderr, "--displays does not go with --compile, "
+                "--record-trace or --stats\n");
+        return EXIT_FAILURE;
     }
 
-    self->data_conn = XOpenDisplay (NULL);
-    self->ctrl_conn = XOpenDisplay (NULL);
+    /* Paths used after daemon () has changed to / */
+    self->mapping_path = absolute_path (self->mapping_path);
+    self->hist_path = absolute_path (self->hist_path);
+    self->stats_path = absolute_path (self->stats_path);
+    control_path = absolute_path (control_path);
+    cache_path = absolute_path (cache_path);
 
-    XkbGetState (self->data_conn, XkbUseCoreKbd, &state);
-    self->intended_group = state.group;
-    self->previous_group = -1;
-
-    if (!self->data_conn || !self->ctrl_conn)
-    {
-        fprintf (stderr, "Unable to connect to X11 display. Is $DISPLAY set?\n");
+    /* With --displays, each display connects in add_displays () */
+    if (displays == NULL && !backend_open (&self->session))
         exit (EXIT_FAILURE);
-    }
-    if (!XQueryExtension (self->ctrl_conn,
-                "XTEST", &dummy, &dummy, &dummy))
-    {
-        fprintf (stderr, "Xtst extension missing\n");
-        exit (EXIT_FAILURE);
-    }
-    if (!XRecordQueryVersion (self->ctrl_conn, &dummy, &dummy))
-    {
-        fprintf (stderr, "Failed to obtain xrecord version\n");
+
+    mapping = read_mapping (self);
+    if (mapping == NULL)
         exit (EXIT_FAILURE);
-    }
-    if (!XkbQueryExtension (self->ctrl_conn, &dummy, &dummy,
-            &dummy, &dummy, &dummy))
+
+    /* Parse only if there is no compiled mapping for this keymap */
+    source_fp = cache_source_fingerprint (mapping);
+    if (displays == NULL && (cache_path == NULL
+                || !cache_load (cache_path, &self->session.engine, source_fp))
+            && !engine_load (&self->session.engine, mapping))
     {
-        fprintf (stderr, "Failed to obtain xkb version\n");
+        fprintf (stderr, "Failed to parse_mapping\n");
         exit (EXIT_FAILURE);
     }
+    if (displays == NULL)
+        free (mapping);
+    startup_mark (&self->session, STARTUP_MAPPING);
 
-    self->map = parse_mapping (self->ctrl_conn, mapping, self->debug);
+    if (compile_path != NULL)
+        exit (cache_write (compile_path, &self->session.engine, source_fp)
+                ? EXIT_SUCCESS : EXIT_FAILURE);
 
-    if (self->map == NULL)
-    {
-        fprintf (stderr, "Failed to parse_mapping\n");
+    if (trace_path != NULL && !trace_create (&self->trace, trace_path))
+        exit (EXIT_FAILURE);
+
+    if (self->stats_path != NULL
+            && !stats_create (&self->stats, self->stats_path,
+                &self->session.engine))
         exit (EXIT_FAILURE);
-    }
 
     if (self->foreground != True)
         daemon (0, 0);
@@ -205,45 +283,82 @@ int main (int argc, char **argv)
     sigemptyset (&self->sigset);
     sigaddset (&self->sigset, SIGINT);
     sigaddset (&self->sigset, SIGTERM);
-    pthread_sigmask (SIG_BLOCK, &self->sigset, NULL);
+    sigaddset (&self->sigset, SIGUSR1);
+    sigaddset (&self->sigset, SIGHUP);
+    sigprocmask (SIG_BLOCK, &self->sigset, NULL);
 
-    pthread_create (&self->sigwait_thread,
-            NULL, sig_handler, self);
+    /* After daemon (), the writer thread would not survive the fork,
+     * and with the signals blocked, which it would otherwise take */
+    if (self->debug)
+    {
+        FILE *out = self->log_out ? self->log_out : stdout;
 
-    self->record_ctx = XRecordCreateContext (self->ctrl_conn,
-            0, &client_spec, 1, &rec_range, 1);
+        if (!log_start (&self->log, out))
+            log_direct (&self->log, out);
+    }
 
-    if (self->record_ctx == 0)
+    self->signal_fd = signalfd (-1, &self->sigset, SFD_CLOEXEC);
+    self->session.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (self->signal_fd < 0 || self->session.epoll_fd < 0)
     {
-        fprintf (stderr, "Failed to create xrecord context\n");
+        perror ("Failed to set up event loop");
         exit (EXIT_FAILURE);
     }
 
-    XSync (self->ctrl_conn, False);
+    if (control_path != NULL && !control_open (self, control_path))
+        exit (EXIT_FAILURE);
 
-    if (!XRecordEnableContext (self->data_conn,
-                self->record_ctx, intercept, (XPointer)self))
+    if (displays != NULL)
+    {
+        /* One per CPU up to a few, sessions mostly wait */
+        if (n_workers == 0)
+        {
+            n_workers = sysconf (_SC_NPROCESSORS_ONLN);
+            if (n_workers > POOL_DEFAULT_WORKERS)
+                n_workers = POOL_DEFAULT_WORKERS;
+            if (n_workers < 1)
+                n_workers = 1;
+        }
+        if (!pool_start (self, n_workers, mapping, cache_path))
+            exit (EXIT_FAILURE);
+        add_displays (self, displays);
+
+        /* Ready once all of them record, see startup_mark () */
+        if (pool_ready (self, NULL))
+            notify_ready (self, &self->log);
+    }
+    else if (!backend_start (&self->session))
     {
-        fprintf (stderr, "Failed to enable xrecord context\n");
         exit (EXIT_FAILURE);
     }
 
-    pthread_join (self->sigwait_thread, NULL);
+    event_loop (self);
 
-    if (!XRecordFreeContext (self->ctrl_conn, self->record_ctx))
-    {
-        fprintf (stderr, "Failed to free xrecord context\n");
-    }
+    control_close (self);
 
-    if (self->debug) fprintf (stdout, "main exiting\n");
+    if (self->pool.n_workers > 0)
+        pool_stop (self);
+    else
+        backend_stop (&self->session);
 
-    XFree (rec_range);
+    if (self->debug)
+    {
+        log_stop (&self->log);
+        fprintf (self->log_out ? self->log_out : stdout, "main exiting\n");
+    }
 
-    XCloseDisplay (self->ctrl_conn);
-    XCloseDisplay (self->data_conn);
+    engine_free (&self->session.engine);
+    trace_close (&self->trace);
+    if (self->stats.header != NULL)
+    {
+        stats_close (&self->stats);
+        unlink (self->stats_path);
+    }
 
-    delete_mapping (self->map);
+    close (self->session.epoll_fd);
+    close (self->signal_fd);
 
+    free (expressions);
     free (self);
 
     return EXIT_SUCCESS;
@@ -251,368 +366,574 @@ int main (int argc, char **argv)
 
 
 /************************************************************************
- * Internal functions
+ * Engine adapter, called by the backend
  ***********************************************************************/
-void *sig_handler (void *user_data)
+void handle_event (Session_t *self, int key_event, KeyCode key_code,
+        Time now)
+{
+    Engine_t *engine = &self->engine;
+    Time down_at = engine->state[key_code].down_at;
+    uint64_t recv_ns = monotonic_ns ();
+    Decision_t decision;
+    int i, n;
+
+    PROBE3 (event, key_event, key_code, now);
+
+    n = engine_handle_event (engine, key_event, key_code, now, &decision);
+
+    if (self->xcape->trace.header != NULL)
+        trace_write (&self->xcape->trace, key_event, key_code, now,
+                recv_ns, decision);
+
+    if (self->debug)
+    {
+        log_put (self->log, LOG_DECISION, key_event, key_code, decision);
+        if (engine->expired != self->expired)
+        {
+            log_put (self->log, LOG_EXPIRED, 0, 0, engine->expired);
+            self->expired = engine->expired;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (self->debug && engine->actions[i].press)
+            log_put (self->log, LOG_GENERATE, engine->actions[i].key, 0,
+                    keymap_sym (&engine->keymap, engine->actions[i].key, 0, 0));
+
+        backend_fake_key (self, engine->actions[i].key,
+                engine->actions[i].press);
+    }
+    if (n > 0)
+    {
+        uint64_t sent_ns;
+
+        backend_flush (self);
+        sent_ns = monotonic_ns () - recv_ns;
+        hist_record (&self->hist_output, sent_ns);
+        PROBE2 (flush, n, sent_ns);
+    }
+
+    /* Every decision from TAP on ends a press seen at down_at */
+    if (decision >= DECISION_TAP)
+        hist_record (&self->hist_hold,
+                (uint64_t)(unsigned int)(now - down_at) * 1000000);
+    record_lag (self, now, recv_ns);
+    hist_record (&self->hist_intercept, monotonic_ns () - recv_ns);
+}
+
+/*
+ * Parse mapping and switch to it between two events. Keys held across
+ * the switch keep their state, mappings in both keep their counters.
+ */
+Bool switch_mapping (XCape_t *self, char *mapping)
 {
-    XCape_t *self = (XCape_t*)user_data;
-    int sig;
+    StatsFile_t old_stats = self->stats;
+    Engine_t *engine = &self->session.engine;
+    char (*names)[MAPPING_NAME_SIZE];
+    MapCounters_t *counters;
+    KeyMap_t *km;
+    int i, n_old = engine->n_maps;
 
-    if (self->debug) fprintf (stdout, "sig_handler running...\n");
+    /* The displays use the mapping without a lock */
+    if (self->pool.n_workers > 0)
+    {
+        fprintf (stderr, "The mapping of --displays cannot change\n");
+        return False;
+    }
 
-    sigwait(&self->sigset, &sig);
+    names = malloc ((n_old + 1) * sizeof (*names));
+    counters = malloc ((n_old + 1) * sizeof (MapCounters_t));
+    if (names == NULL || counters == NULL)
+    {
+        perror ("Failed to switch mapping");
+        free (names);
+        free (counters);
+        return False;
+    }
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        engine_mapping_name (km, names[km->index], MAPPING_NAME_SIZE);
+        counters[km->index] = engine->counters[km->index];
+    }
 
-    if (self->debug) fprintf (stdout, "Caught signal %d!\n", sig);
+    if (!engine_load (engine, mapping))
+    {
+        free (names);
+        free (counters);
+        return False;
+    }
 
-    XLockDisplay (self->ctrl_conn);
+    for (km = engine->map; km != NULL; km = km->next)
+    {
+        char name[MAPPING_NAME_SIZE];
 
-    if (!XRecordDisableContext (self->ctrl_conn,
-                self->record_ctx))
+        engine_mapping_name (km, name, MAPPING_NAME_SIZE);
+        for (i = 0; i < n_old; i++)
+        {
+            if (strcmp (name, names[i]) == 0)
+                engine->counters[km->index] = counters[i];
+        }
+    }
+    free (names);
+    free (counters);
+
+    /* Publish the new set of mappings before unmapping the old */
+    if (self->stats.header != NULL)
     {
-        fprintf (stderr, "Failed to disable xrecord context\n");
-        exit(EXIT_FAILURE);
+        if (!stats_create (&self->stats, self->stats_path, engine))
+            memset (&self->stats, 0, sizeof (StatsFile_t));
+        stats_close (&old_stats);
     }
 
-    XSync (self->ctrl_conn, False);
+    if (self->debug)
+        log_put (&self->log, LOG_RELOAD, engine->n_maps, 0, 0);
 
-    XUnlockDisplay (self->ctrl_conn);
+    return True;
+}
 
-    if (self->debug) fprintf (stdout, "sig_handler exiting...\n");
+void keymap_changed (Session_t *self, int first, int count)
+{
+    if (self->debug) log_put (self->log, LOG_KEYMAP, first, count, 0);
 
-    return NULL;
+    engine_keymap_changed (&self->engine, first, count);
 }
 
-Key_t *key_add_key (Key_t *keys, KeyCode key)
+void handle_group_change (Session_t *self, int group,
+        KeyCode key_code, Time when)
 {
-    Key_t *rval = keys;
+    int intended = self->engine.intended_group;
 
-    if (keys == NULL)
+    if (engine_group_changed (&self->engine, group, key_code, when))
     {
-        keys = malloc (sizeof (Key_t));
-        rval = keys;
+        backend_lock_group (self, self->engine.intended_group);
+        backend_flush (self);
     }
-    else
+    else if (self->debug && self->engine.intended_group != intended)
     {
-        while (keys->next != NULL) keys = keys->next;
-        keys = (keys->next = malloc (sizeof (Key_t)));
+        log_put (self->log, LOG_GROUP, group, 0, 0);
     }
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+/*
+ * Server and client clocks are unrelated, so the delivery lag is taken
+ * relative to the quickest delivery seen so far.
+ */
+void record_lag (Session_t *self, Time now, uint64_t recv_ns)
+{
+    int64_t offset = (int64_t)(recv_ns / 1000) - (int64_t)now * 1000;
 
-    keys->key = key;
-    keys->next = NULL;
+    if (self->hist_lag.count == 0 || offset < self->lag_base)
+        self->lag_base = offset;
 
-    return rval;
+    hist_record (&self->hist_lag, (offset - self->lag_base) * 1000);
 }
 
-void handle_key (XCape_t *self, KeyMap_t *key,
-        Bool mouse_pressed, int key_event)
+void startup_mark (Session_t *self, Startup_t point)
 {
-    Key_t *k;
+    if (self->startup[point] != 0)
+        return;
+
+    self->startup[point] = monotonic_ns ();
 
-    if (key_event == KeyPress)
+    /* With --displays, once the last of them records */
+    if (point == STARTUP_READY && (self->display == NULL
+                || pool_ready (self->xcape, self)))
+        notify_ready (self->xcape, self->log);
+}
+
+const char *startup_name (Startup_t point)
+{
+    static const char *names[STARTUP_POINTS] =
     {
-        if (self->debug) fprintf (stdout, "Key pressed!\n");
+        "main", "connect", "extensions", "keymap", "mapping", "ready"
+    };
 
-        key->pressed = True;
+    return names[point];
+}
 
-        gettimeofday (&key->down_at, NULL);
+/* The time between the points of startup, as far as they were reached */
+void dump_startup (Session_t *self, FILE *f)
+{
+    uint64_t last = self->startup[STARTUP_MAIN];
+    int i;
 
-        if (mouse_pressed)
+    for (i = STARTUP_MAIN + 1; i < STARTUP_POINTS; i++)
+    {
+        if (self->startup[i] == 0)
+            continue;
+        fprintf (f, "startup %s %lu us\n", startup_name (i),
+                (unsigned long)(self->startup[i] - last) / 1000);
+        last = self->startup[i];
+    }
+}
+
+void dump_histograms (Session_t *self, FILE *f)
+{
+    hist_print (&self->hist_intercept, f);
+    hist_print (&self->hist_lag, f);
+    hist_print (&self->hist_hold, f);
+    hist_print (&self->hist_output, f);
+}
+
+/* Read while its worker writes, which a few odd counts can live with */
+void dump_display (Session_t *session, FILE *f)
+{
+    fprintf (f, "display %s\n", session->display);
+    dump_histograms (session, f);
+}
+
+/*
+ * Recording has started: report the startup times and tell whoever
+ * started xcape, on --ready-fd and, as sd_notify () does, on
+ * $NOTIFY_SOCKET. Keys typed from now on reach xcape. With --displays
+ * called once, by the thread of the last display to record, which
+ * logs to its own log.
+ */
+void notify_ready (XCape_t *self, Log_t *log)
+{
+    const char *path = getenv ("NOTIFY_SOCKET");
+    uint64_t *t = self->session.startup, last = t[STARTUP_MAIN];
+    struct sockaddr_un addr;
+    char msg[128];
+    int i, fd, len;
+
+    if (t[STARTUP_READY] == 0)
+        t[STARTUP_READY] = monotonic_ns ();
+
+    if (self->debug)
+    {
+        for (i = STARTUP_MAIN + 1; i < STARTUP_POINTS; i++)
         {
-            key->used = True;
+            if (t[i] == 0)
+                continue;
+            log_put (log, LOG_STARTUP, (t[i] - last) / 1000,
+                    (t[i] - t[STARTUP_MAIN]) / 1000,
+                    (uintptr_t)startup_name (i));
+            last = t[i];
         }
     }
-    else
+
+    if (self->ready_fd >= 0)
     {
-        if (self->debug) fprintf (stdout, "Key released!\n");
-        if (key->used == False)
-        {
-            struct timeval timev = self->timeout;
-            gettimeofday (&timev, NULL);
-            timersub (&timev, &key->down_at, &timev);
+        if (write (self->ready_fd, "READY=1\n", 8) < 0)
+            perror ("--ready-fd");
+        close (self->ready_fd);
+        self->ready_fd = -1;
+    }
 
-            if (timercmp (&timev, &self->timeout, <))
-            {
-                for (k = key->to_keys; k != NULL; k = k->next)
-                {
-                    if (self->debug) fprintf (stdout, "Generating %s!\n",
-                            XKeysymToString (XkbKeycodeToKeysym (self->ctrl_conn,
-                                    k->key, 0, 0)));
+    /* A path, or an abstract socket if it starts with @ */
+    if (path == NULL || (path[0] != '/' && path[0] != '@')
+            || strlen (path) >= sizeof (addr.sun_path))
+        return;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+
+    /* The pid changed with daemon () */
+    len = snprintf (msg, sizeof (msg),
+            "READY=1\nMAINPID=%d\nSTATUS=Ready after %lu ms\n", getpid (),
+            (unsigned long)(t[STARTUP_READY] - t[STARTUP_MAIN]) / 1000000);
+
+    fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || sendto (fd, msg, len, MSG_NOSIGNAL, (struct sockaddr *)&addr,
+                offsetof (struct sockaddr_un, sun_path) + strlen (path)) < 0)
+        perror ("NOTIFY_SOCKET");
+    if (fd >= 0)
+        close (fd);
+}
 
-                    XTestFakeKeyEvent (self->ctrl_conn,
-                            k->key, True, 0);
-                    self->generated = key_add_key (self->generated, k->key);
-                }
-                for (k = key->to_keys; k != NULL; k = k->next)
-                {
-                    XTestFakeKeyEvent (self->ctrl_conn,
-                            k->key, False, 0);
-                    self->generated = key_add_key (self->generated, k->key);
-                }
-                XFlush (self->ctrl_conn);
-            }
+/* On SIGUSR1 */
+void write_histograms (XCape_t *self)
+{
+    FILE *f = stdout;
+
+    if (self->hist_path != NULL)
+    {
+        f = fopen (self->hist_path, "w");
+        if (f == NULL)
+        {
+            perror (self->hist_path);
+            return;
         }
-        key->used = False;
-        key->pressed = False;
     }
+
+    if (self->pool.n_workers > 0)
+        pool_foreach (self, dump_display, f);
+    else
+        dump_histograms (&self->session, f);
+
+    if (f != stdout)
+        fclose (f);
+    else
+        fflush (f);
 }
 
-void intercept (XPointer user_data, XRecordInterceptData *data)
+/*
+ * path resolved against the current directory, kept for the life of
+ * the process. Files that do not exist yet keep their last component.
+ */
+const char *absolute_path (const char *path)
 {
-    XCape_t *self = (XCape_t*)user_data;
-    static Bool mouse_pressed = False;
-    KeyMap_t *km;
-    XkbStateRec state;
-    unsigned char current_group;
+    char *resolved, *cwd;
 
-    XkbGetState (self->ctrl_conn, XkbUseCoreKbd, &state);
-    current_group = state.group;
+    if (path == NULL)
+        return NULL;
 
-    XLockDisplay (self->ctrl_conn);
+    resolved = realpath (path, NULL);
+    if (resolved != NULL || path[0] == '/')
+        return resolved != NULL ? resolved : path;
 
-    if (data->category == XRecordFromServer)
-    {
-        int     key_event = data->data[0];
-        KeyCode key_code  = data->data[1];
-        Key_t *g, *g_prev = NULL;
+    cwd = getcwd (NULL, 0);
+    if (cwd == NULL)
+        return path;
+    resolved = malloc (strlen (cwd) + strlen (path) + 2);
+    sprintf (resolved, "%s/%s", cwd, path);
+    free (cwd);
 
-        for (g = self->generated; g != NULL; g = g->next)
-        {
-            if (g->key == key_code)
-            {
-                if (self->debug) fprintf (stdout,
-                        "Ignoring generated event.\n");
-                if (g_prev != NULL)
-                {
-                    g_prev->next = g->next;
-                }
-                else
-                {
-                    self->generated = g->next;
-                }
-                free (g);
-                goto exit;
-            }
-            g_prev = g;
-        }
+    return resolved;
+}
 
-        if (self->debug) fprintf (stdout,
-                "Intercepted key event %d, key code %d\n",
-                key_event, key_code);
+/*
+ * The mapping to parse, in a buffer for the caller to free. Lines of a
+ * mapping file are joined with ';'.
+ */
+char *read_mapping (XCape_t *self)
+{
+    char *buf, *c, *grown;
+    size_t len = 0, cap = 256;
+    FILE *f;
+    int ch;
 
-        if (key_event == ButtonPress)
-        {
-            mouse_pressed = True;
-        }
-        else if (key_event == ButtonRelease)
-        {
-            mouse_pressed = False;
-        }
-        for (km = self->map; km != NULL; km = km->next)
+    if (self->mapping_path == NULL)
+    {
+        buf = strdup (self->mapping);
+        if (buf == NULL)
+            perror ("Failed to read mapping");
+        return buf;
+    }
+
+    f = fopen (self->mapping_path, "r");
+    if (f == NULL)
+    {
+        perror (self->mapping_path);
+        return NULL;
+    }
+
+    buf = malloc (cap);
+    while (buf != NULL && (ch = getc (f)) != EOF)
+    {
+        if (len + 2 > cap)
         {
-            if ((km->UseKeyCode == False
-                    && XkbKeycodeToKeysym (self->ctrl_conn, key_code, 0, 0)
-                        == km->from_ks)
-                || (km->UseKeyCode == True
-                    && key_code == km->from_kc))
-            {
-                handle_key (self, km, mouse_pressed, key_event);
-            }
-            else if (km->pressed
-                    && (key_event == KeyPress || key_event == ButtonPress))
-            {
-                km->used = True;
-            }
+            grown = realloc (buf, cap *= 2);
+            if (grown == NULL)
+                free (buf);
+            buf = grown;
+            if (buf == NULL)
+                break;
         }
+        if (ch == '\n')
+            ch = ';';
+        /* Skip empty lines and separators */
+        if (ch == ';' && (len == 0 || buf[len - 1] == ';'))
+            continue;
+        if (ch != ' ' && ch != '\t' && ch != '\r')
+            buf[len++] = ch;
     }
+    fclose (f);
 
-    if (self->previous_group != current_group)
+    if (buf == NULL)
     {
-        self->intended_group = current_group;
+        perror (self->mapping_path);
+        return NULL;
+    }
+
+    if (len > 0 && buf[len - 1] == ';')
+        len--;
+    buf[len] = '\0';
 
-        if (self->debug)
-            fprintf (stdout, "Changed group to %d\n", current_group);
+    for (c = buf; *c == ';'; c++)
+        ;
+    if (*c == '\0')
+    {
+        fprintf (stderr, "No mappings in %s\n", self->mapping_path);
+        free (buf);
+        return NULL;
     }
 
-    XkbLockGroup (self->ctrl_conn, XkbUseCoreKbd, self->intended_group);
-    XkbGetState (self->ctrl_conn, XkbUseCoreKbd, &state);
-    self->previous_group = state.group;
+    return buf;
+}
+
+Bool reload_mapping (XCape_t *self)
+{
+    char *mapping = read_mapping (self);
+    Bool ok = mapping != NULL && switch_mapping (self, mapping);
+
+    if (!ok)
+        fprintf (stderr, "Failed to reload mapping, keeping the old one\n");
+    free (mapping);
 
-exit:
-    XUnlockDisplay (self->ctrl_conn); 
-    XRecordFreeData (data);
+    return ok;
 }
 
-KeyMap_t *parse_token (Display *dpy, char *token, Bool debug)
+uint64_t monotonic_ns (void)
 {
-    KeyMap_t *km = NULL;
-    KeySym    ks;
-    char      *from, *to, *key;
-    KeyCode   code;           /* keycode */
-    long      parsed_code;    /* parsed keycode value */
+    struct timespec ts;
 
-    to = token;
-    from = strsep (&to, "=");
-    if (to != NULL)
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void event_loop (XCape_t *self)
+{
+    struct epoll_event ev, events[4 + CONTROL_CLIENTS];
+    struct signalfd_siginfo si;
+    int i, n;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = self->signal_fd;
+    if (epoll_ctl (self->session.epoll_fd, EPOLL_CTL_ADD, self->signal_fd,
+                &ev) < 0 || (self->session.backend != NULL
+                && !watch_session (&self->session)))
     {
-        km = calloc (1, sizeof (KeyMap_t));
+        perror ("epoll_ctl");
+        return;
+    }
 
-        if (!strncmp (from, "#", 1)
-               && strsep (&from, "#") != NULL)
+    for (;;)
+    {
+        /* The backend may have read data while waiting for a reply */
+        if (self->session.backend != NULL)
         {
-            errno = 0;
-            parsed_code = strtoul (from, NULL, 0); /* dec, oct, hex automatically */
-            if (errno == 0
-                   && parsed_code <=255
-                   && XkbKeycodeToKeysym (dpy, (KeyCode) parsed_code, 0, 0) != NoSymbol)
-            {
-                km->UseKeyCode = True;
-                km->from_kc = (KeyCode) parsed_code;
-                if (debug)
-                {
-                  KeySym ks_temp = XkbKeycodeToKeysym (dpy, (KeyCode) parsed_code, 0, 0);
-                  fprintf(stderr, "Assigned mapping from \"%s\" ( keysym 0x%x, "
-                          "key code %d)\n",
-                          XKeysymToString(ks_temp),
-                          (unsigned) ks_temp,
-                          (unsigned) km->from_kc);
-                }
-            }
-            else
-            {
-                fprintf (stderr, "Invalid keycode: %s\n", from);
-                return NULL;
-            }
+            backend_process_data (&self->session);
+            backend_process_ctrl (&self->session);
         }
-        else
+        if (self->session.lost)
         {
-            if ((ks = XStringToKeysym (from)) == NoSymbol)
-            {
-                fprintf (stderr, "Invalid key: %s\n", token);
-                return NULL;
-            }
-
-            km->UseKeyCode  = False;
-            km->from_ks     = ks;
-            km->to_keys     = NULL;
-
-            if (debug)
-            {
-              fprintf(stderr, "Assigned mapping from \"%s\" ( keysym 0x%x, "
-                      "key code %d)\n",
-                      XKeysymToString (km->from_ks),
-                      (unsigned) km->from_ks,
-                      (unsigned) XKeysymToKeycode (dpy, km->from_ks));
-            }
+            fprintf (stderr, "Lost the connection to the X server\n");
+            return;
         }
 
-        for(;;)
+        n = epoll_wait (self->session.epoll_fd, events,
+                4 + CONTROL_CLIENTS, -1);
+        if (n < 0)
         {
-            key = strsep (&to, "|");
-            if (key == NULL)
-                break;
-
-            if (!strncmp (key, "#", 1)
-                   && strsep (&key, "#") != NULL)
-            {
-                errno = 0;
-                parsed_code = strtoul (key, NULL, 0); /* dec, oct, hex automatically */
-                if (!(errno == 0
-                      && parsed_code <=255
-                      && XkbKeycodeToKeysym (dpy, (KeyCode) parsed_code, 0, 0) != NoSymbol))
-                {
-                    fprintf (stderr, "Invalid keycode: %s\n", key);
-                    return NULL;
-                }
+            if (errno == EINTR)
+                continue;
+            perror ("epoll_wait");
+            return;
+        }
 
-                code = (KeyCode) parsed_code;
-            }
-            else
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == self->signal_fd)
             {
-                if ((ks = XStringToKeysym (key)) == NoSymbol)
+                if (read (self->signal_fd, &si, sizeof (si)) != sizeof (si))
+                    continue;
+                if (si.ssi_signo == SIGUSR1)
                 {
-                    fprintf (stderr, "Invalid key: %s\n", key);
-                    return NULL;
+                    write_histograms (self);
+                    continue;
                 }
-
-                code = XKeysymToKeycode (dpy, ks);
-                if (code == 0)
+                if (si.ssi_signo == SIGHUP)
                 {
-                    fprintf (stderr, "WARNING: No keycode found for keysym "
-                            "%s (0x%x) in mapping %s. Ignoring this "
-                            "mapping.\n", key, (unsigned int)ks, token);
-                    return NULL;
+                    reload_mapping (self);
+                    continue;
                 }
+                if (self->debug)
+                    log_put (&self->log, LOG_SIGNAL, si.ssi_signo, 0, 0);
+                return;
             }
-
-            km->to_keys = key_add_key (km->to_keys, code);
-            if (debug)
+            else if (self->session.backend == NULL
+                    || !handle_fd (&self->session, events[i].data.fd))
             {
-              KeySym ks_temp = XkbKeycodeToKeysym (dpy, code, 0, 0);
-              fprintf(stderr, "to \"%s\" (keysym 0x%x, key code %d)\n",
-                  XKeysymToString(ks_temp),
-                  (unsigned) ks_temp,
-                  (unsigned) code);
+                control_handle (self, events[i].data.fd, events[i].events);
             }
         }
     }
-    else
-        fprintf (stderr, "WARNING: Mapping without = has no effect: '%s'\n", token);
-
-
-    return km;
 }
 
-KeyMap_t *parse_mapping (Display *ctrl_conn, char *mapping, Bool debug)
+/* Add the record stream and notifications to epoll_fd */
+Bool watch_session (Session_t *self)
 {
-    char     *token;
-    KeyMap_t *rval, *km, *nkm;
-
-    rval = km = NULL;
+    struct epoll_event ev;
+    int fds[2], i;
 
-    for(;;)
+    fds[0] = self->data_fd;
+    fds[1] = self->ctrl_fd;
+    for (i = 0; i < 2; i++)
     {
-        token = strsep (&mapping, ";");
-        if (token == NULL)
-            break;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl (self->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+            return False;
+    }
 
-        nkm = parse_token (ctrl_conn, token, debug);
+    return True;
+}
 
-        if (nkm != NULL)
-        {
-            if (km == NULL)
-                rval = km = nkm;
-            else
-            {
-                km->next = nkm;
-                km = nkm;
-            }
-        }
+/* Returns False if fd is not one of watch_session ()'s */
+Bool handle_fd (Session_t *self, int fd)
+{
+    if (fd == self->data_fd)
+    {
+        backend_process_data (self);
+    }
+    else if (fd == self->ctrl_fd)
+    {
+        backend_process_ctrl (self);
+    }
+    else
+    {
+        return False;
     }
 
-    return rval;
+    return True;
 }
 
-void delete_mapping (KeyMap_t *map)
+/* What event_loop () does for one of --displays, by its worker */
+void session_dispatch (Session_t *self)
 {
-    while (map != NULL) {
-        KeyMap_t *next = map->next;
-        delete_keys (map->to_keys);
-        free (map);
-        map = next;
-    }
+    struct epoll_event events[2];
+    int i, n;
+
+    n = epoll_wait (self->epoll_fd, events, 2, 0);
+    for (i = 0; i < n; i++)
+        handle_fd (self, events[i].data.fd);
+
+    /* Nothing wakes the worker for what the backend read ahead */
+    backend_process_data (self);
+    backend_process_ctrl (self);
 }
 
-void delete_keys (Key_t *keys)
+/* A comma separated list; a display that fails is left out */
+void add_displays (XCape_t *self, const char *list)
 {
-    while (keys != NULL) {
-        Key_t *next = keys->next;
-        free (keys);
-        keys = next;
+    char *copy = strdup (list), *display, *save;
+
+    for (display = strtok_r (copy, ", ", &save); display != NULL;
+            display = strtok_r (NULL, ", ", &save))
+    {
+        if (!pool_add (self, display))
+            fprintf (stderr, "Not serving display %s\n", display);
     }
+    free (copy);
 }
 
 void print_usage (const char *program_name)
 {
-    fprintf (stdout, "Usage: %s [-d] [-f] [-t timeout_ms] [-e <mapping>]\n", program_name);
+    fprintf (stdout, "Usage: %s [-d] [-f] [-t timeout_ms] [-e <mapping>] "
+            "[--mapping-file <file>] [--record-trace <file>] "
+            "[--histograms <file>] [--stats <file>] [--log <file>] "
+            "[--control <socket>] [--compile <file>] [--cache <file>] "
+            "[--ready-fd <fd>] [--displays <list>] [--workers <n>] "
+            "[--devices <list>]\n",
+            program_name);
     fprintf (stdout, "Runs as a daemon unless -d or -f flag is set\n");
 }
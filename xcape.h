@@ -0,0 +1,166 @@
+/************************************************************************
+ * xcape.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#ifndef XCAPE_H
+#define XCAPE_H
+
+#include <signal.h>
+#include <X11/Xlib.h>
+
+#include "engine.h"
+#include "trace.h"
+#include "hist.h"
+#include "stats.h"
+#include "log.h"
+#include "control.h"
+#include "cache.h"
+#include "pool.h"
+
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+/* Connection state private to the backend */
+typedef struct _Backend_t Backend_t;
+
+/* Points of startup, timed from main () */
+typedef enum _Startup_t
+{
+    STARTUP_MAIN = 0,
+    STARTUP_CONNECT,            /* both connections open */
+    STARTUP_EXTENSIONS,         /* extensions queried */
+    STARTUP_KEYMAP,             /* keymap and keyboard state read */
+    STARTUP_MAPPING,            /* mapping parsed or loaded */
+    STARTUP_READY,              /* the server has started recording */
+    STARTUP_POINTS
+} Startup_t;
+
+/*
+ * What is kept per display: the connections, record context, key
+ * state and timings. XCape_t has one for $DISPLAY; with
+ * --displays each display is a session served by a worker, see pool.h.
+ */
+typedef struct _Session_t
+{
+    Backend_t *backend;
+    int data_fd;                /* key events, see backend_process_data */
+    int ctrl_fd;                /* notifications, see backend_process_ctrl */
+    int epoll_fd;
+    Engine_t engine;
+    unsigned long expired;      /* engine.expired as last reported */
+    Histogram_t hist_intercept; /* handling of one event */
+    Histogram_t hist_lag;       /* record delivery, beyond the least seen */
+    Histogram_t hist_hold;      /* press to release of mapped keys */
+    Histogram_t hist_output;    /* receiving a release to flushing a tap */
+    int64_t lag_base;           /* least receive minus server time, in us */
+    uint64_t startup[STARTUP_POINTS];   /* monotonic_ns () of each, or 0 */
+    const char *display;        /* one of --displays, NULL for $DISPLAY */
+    Bool debug;                 /* log to *log */
+    Log_t *log;                 /* of the thread serving the session */
+    Bool lost;                  /* the connection to the server broke */
+    Bool closing;               /* to be closed by its worker */
+    Bool starting;              /* READY waits for it, see pool_ready () */
+    Worker_t *worker;           /* serving this one of --displays */
+    struct _Session_t *next;    /* in Pool_t.sessions */
+    struct _XCape_t *xcape;     /* the process it belongs to */
+} Session_t;
+
+typedef struct _XCape_t
+{
+    Session_t session;          /* $DISPLAY, or the mapping of --displays */
+    int signal_fd;
+    sigset_t sigset;
+    Bool foreground;
+    Bool debug;                 /* log to log_out, -d or --log */
+    FILE *log_out;
+    const char *mapping;        /* -e, if not read from mapping_path */
+    const char *mapping_path;   /* --mapping-file, read again on SIGHUP */
+    TraceFile_t trace;          /* header is NULL unless --record-trace */
+    const char *stats_path;
+    StatsFile_t stats;          /* header is NULL unless --stats */
+    const char *hist_path;      /* where SIGUSR1 dumps, stdout if NULL */
+    Log_t log;                  /* of the main thread */
+    Control_t control;
+    int ready_fd;               /* --ready-fd, -1 once notified */
+    const char *devices;        /* --devices, NULL for all keyboards */
+    Pool_t pool;                /* serving --displays */
+} XCape_t;
+
+/* Room for the name of one mapping, see engine_mapping_name () */
+#define MAPPING_NAME_SIZE 256
+
+/************************************************************************
+ * Called by the backend
+ ***********************************************************************/
+void handle_event (Session_t *self, int key_event, KeyCode key_code,
+        Time now);
+
+void keymap_changed (Session_t *self, int first, int count);
+
+void handle_group_change (Session_t *self, int group,
+        KeyCode key_code, Time when);
+
+/* STARTUP_READY once the record context delivers its start of data */
+void startup_mark (Session_t *self, Startup_t point);
+
+/************************************************************************
+ * Called by the control socket
+ ***********************************************************************/
+Bool switch_mapping (XCape_t *self, char *mapping);
+
+Bool reload_mapping (XCape_t *self);
+
+void dump_histograms (Session_t *self, FILE *f);
+
+void dump_startup (Session_t *self, FILE *f);
+
+/************************************************************************
+ * Called by the worker pool
+ ***********************************************************************/
+Bool watch_session (Session_t *self);
+
+void session_dispatch (Session_t *self);
+
+/* Once every display of --displays records, see pool_ready () */
+void notify_ready (XCape_t *self, Log_t *log);
+
+/************************************************************************
+ * Backend interface, see backend-xlib.c, backend-xcb.c and backend-xi2.c,
+ * the Xlib ones share xlib-ctrl.c
+ ***********************************************************************/
+Bool backend_open (Session_t *self);
+
+Bool backend_start (Session_t *self);
+
+void backend_stop (Session_t *self);
+
+void backend_close (Session_t *self);
+
+void backend_process_data (Session_t *self);
+
+void backend_process_ctrl (Session_t *self);
+
+void backend_fake_key (Session_t *self, KeyCode key, Bool press);
+
+void backend_lock_group (Session_t *self, int group);
+
+void backend_flush (Session_t *self);
+
+#endif /* XCAPE_H */
@@ -0,0 +1,289 @@
+/************************************************************************
+ * xlib-ctrl.c
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/XTest.h>
+#include <X11/XKBlib.h>
+#include <xcb/xcbext.h>
+
+#include "xlib-ctrl.h"
+
+
+/* Without libxcb-xtest, -record or -xinput, only their names are used */
+static xcb_extension_t xlib_ext_xtest = { "XTEST", 0 };
+xcb_extension_t xlib_ext_record = { "RECORD", 0 };
+xcb_extension_t xlib_ext_xinput = { "XInputExtension", 0 };
+
+/************************************************************************
+ * Internal function declarations
+ ***********************************************************************/
+#ifdef HAVE_XLIB_IO_EXIT
+void connection_lost (Display *dpy, void *user_data);
+#endif
+
+void refresh_keymap (Session_t *self, int first, int count);
+
+void copy_keys (Keymap_t *keymap, XkbDescPtr xkb, int first, int last);
+
+/************************************************************************
+ * Control connection interface
+ ***********************************************************************/
+Bool xlib_ctrl_connect (Session_t *self, XlibCtrl_t *ctrl,
+        Display **data_conn, xcb_extension_t *data_ext)
+{
+    xcb_connection_t *data_xcb;
+
+    *data_conn = XOpenDisplay (self->display);
+    ctrl->conn = XOpenDisplay (self->display);
+
+    if (!*data_conn || !ctrl->conn)
+    {
+        if (self->display != NULL)
+            fprintf (stderr, "Unable to connect to X11 display %s\n",
+                    self->display);
+        else
+            fprintf (stderr, "Unable to connect to X11 display. "
+                    "Is $DISPLAY set?\n");
+        return False;
+    }
+
+#ifdef HAVE_XLIB_IO_EXIT
+    /* Instead of exiting, see Session_t.lost */
+    XSetIOErrorExitHandler (*data_conn, connection_lost, self);
+    XSetIOErrorExitHandler (ctrl->conn, connection_lost, self);
+#endif
+    self->ctrl_fd = ConnectionNumber (ctrl->conn);
+    startup_mark (self, STARTUP_CONNECT);
+
+    /* Nothing was sent through Xlib yet, so nothing goes out of order */
+    data_xcb = XGetXCBConnection (*data_conn);
+    xcb_prefetch_extension_data (data_xcb, data_ext);
+    xcb_flush (data_xcb);
+    xcb_prefetch_extension_data (XGetXCBConnection (ctrl->conn),
+            &xlib_ext_xtest);
+
+    return True;
+}
+
+/*
+ * Xlib's XKB looks its extension up with a blocking XQueryExtension ()
+ * of its own, which does not use XCB's cache, and then asks for the
+ * version: two round trips, during which the replies to the queries
+ * sent by xlib_ctrl_connect () arrive.
+ */
+Bool xlib_ctrl_query (XlibCtrl_t *ctrl)
+{
+    int dummy;
+
+    if (!XkbQueryExtension (ctrl->conn, &dummy, &ctrl->xkb_event,
+            &dummy, &dummy, &dummy))
+    {
+        fprintf (stderr, "Failed to obtain xkb version\n");
+        return False;
+    }
+    if (!xlib_extension (ctrl->conn, &xlib_ext_xtest, &dummy))
+    {
+        fprintf (stderr, "Xtst extension missing\n");
+        return False;
+    }
+
+    return True;
+}
+
+Bool xlib_extension (Display *dpy, xcb_extension_t *ext, int *opcode)
+{
+    const xcb_query_extension_reply_t *reply;
+
+    reply = xcb_get_extension_data (XGetXCBConnection (dpy), ext);
+    if (reply == NULL || !reply->present)
+        return False;
+
+    *opcode = reply->major_opcode;
+    return True;
+}
+
+Bool xlib_ctrl_keymap (Session_t *self, XlibCtrl_t *ctrl)
+{
+    XkbStateRec state;
+
+    ctrl->xkb = XkbGetMap (ctrl->conn, XkbKeySymsMask, XkbUseCoreKbd);
+    if (ctrl->xkb == NULL)
+    {
+        fprintf (stderr, "Failed to get keyboard mapping\n");
+        return False;
+    }
+    copy_keys (&self->engine.keymap, ctrl->xkb, 0, 255);
+
+    XkbSelectEvents (ctrl->conn, XkbUseCoreKbd,
+            XkbNewKeyboardNotifyMask | XkbMapNotifyMask,
+            XkbNewKeyboardNotifyMask | XkbMapNotifyMask);
+    XkbSelectEventDetails (ctrl->conn, XkbUseCoreKbd, XkbStateNotify,
+            XkbGroupLockMask, XkbGroupLockMask);
+
+    XkbGetState (ctrl->conn, XkbUseCoreKbd, &state);
+    self->engine.intended_group = state.locked_group;
+    startup_mark (self, STARTUP_KEYMAP);
+
+    return True;
+}
+
+void xlib_ctrl_close (XlibCtrl_t *ctrl)
+{
+    if (ctrl->conn != NULL)
+        XCloseDisplay (ctrl->conn);
+
+    if (ctrl->xkb != NULL)
+        XkbFreeKeyboard (ctrl->xkb, 0, True);
+
+    ctrl->conn = NULL;
+    ctrl->xkb = NULL;
+}
+
+/************************************************************************
+ * Backend interface, the part that is the same for both backends
+ ***********************************************************************/
+void backend_process_ctrl (Session_t *self)
+{
+    XlibCtrl_t *ctrl = xlib_ctrl (self);
+    XEvent ev;
+    XkbEvent *xkb_ev = (XkbEvent*)&ev;
+
+    while (XEventsQueued (ctrl->conn, QueuedAfterReading) > 0)
+    {
+        XNextEvent (ctrl->conn, &ev);
+
+        if (ev.type == MappingNotify
+                && ev.xmapping.request == MappingKeyboard)
+        {
+            refresh_keymap (self, ev.xmapping.first_keycode,
+                    ev.xmapping.count);
+        }
+        else if (ev.type == ctrl->xkb_event
+                && xkb_ev->any.xkb_type == XkbMapNotify
+                && (xkb_ev->map.changed & XkbKeySymsMask))
+        {
+            refresh_keymap (self, xkb_ev->map.first_key_sym,
+                    xkb_ev->map.num_key_syms);
+        }
+        else if (ev.type == ctrl->xkb_event
+                && xkb_ev->any.xkb_type == XkbNewKeyboardNotify)
+        {
+            refresh_keymap (self, 0, 0);
+        }
+        else if (ev.type == ctrl->xkb_event
+                && xkb_ev->any.xkb_type == XkbStateNotify
+                && (xkb_ev->state.changed & XkbGroupLockMask))
+        {
+            handle_group_change (self, xkb_ev->state.locked_group,
+                    xkb_ev->state.keycode, xkb_ev->state.time);
+        }
+    }
+}
+
+void backend_fake_key (Session_t *self, KeyCode key, Bool press)
+{
+    XTestFakeKeyEvent (xlib_ctrl (self)->conn, key, press, 0);
+}
+
+void backend_lock_group (Session_t *self, int group)
+{
+    XkbLockGroup (xlib_ctrl (self)->conn, XkbUseCoreKbd, group);
+}
+
+void backend_flush (Session_t *self)
+{
+    XFlush (xlib_ctrl (self)->conn);
+}
+
+/************************************************************************
+ * Internal functions
+ ***********************************************************************/
+#ifdef HAVE_XLIB_IO_EXIT
+/* Xlib returns to the caller, and fails every later call on dpy */
+void connection_lost (Display *dpy, void *user_data)
+{
+    ((Session_t *)user_data)->lost = True;
+}
+#endif
+
+/* Re-fetch count key codes from first, or the whole map if count is 0 */
+void refresh_keymap (Session_t *self, int first, int count)
+{
+    XlibCtrl_t *ctrl = xlib_ctrl (self);
+
+    if (count == 0)
+    {
+        XkbDescPtr xkb = XkbGetMap (ctrl->conn,
+                XkbKeySymsMask, XkbUseCoreKbd);
+        if (xkb == NULL)
+        {
+            fprintf (stderr, "Failed to get keyboard mapping\n");
+            return;
+        }
+        XkbFreeKeyboard (ctrl->xkb, 0, True);
+        ctrl->xkb = xkb;
+        first = 0;
+        count = 256;
+    }
+    else if (XkbGetKeySyms (ctrl->conn, first, count,
+                ctrl->xkb) != Success)
+    {
+        fprintf (stderr, "Failed to update keyboard mapping\n");
+        return;
+    }
+
+    copy_keys (&self->engine.keymap, ctrl->xkb, first, first + count - 1);
+    keymap_changed (self, first, count);
+}
+
+void copy_keys (Keymap_t *keymap, XkbDescPtr xkb, int first, int last)
+{
+    int kc, group, level;
+
+    keymap->min_key_code = xkb->min_key_code;
+    keymap->max_key_code = xkb->max_key_code;
+
+    for (kc = first; kc <= last; kc++)
+    {
+        int groups = 0, width = 0;
+
+        if (kc >= xkb->min_key_code && kc <= xkb->max_key_code)
+        {
+            groups = XkbKeyNumGroups (xkb, kc);
+            width = XkbKeyGroupsWidth (xkb, kc);
+        }
+        if (groups > KEYMAP_GROUPS)
+            groups = KEYMAP_GROUPS;
+        if (width > KEYMAP_LEVELS)
+            width = KEYMAP_LEVELS;
+
+        keymap->groups[kc] = groups;
+        keymap->width[kc] = width;
+        for (group = 0; group < groups; group++)
+        {
+            for (level = 0; level < width; level++)
+                keymap->syms[kc][group][level] =
+                    XkbKeySymEntry (xkb, kc, level, group);
+        }
+    }
+}
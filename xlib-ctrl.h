@@ -0,0 +1,83 @@
+/************************************************************************
+ * xlib-ctrl.h
+ *
+ * Copyright 2015 Albin Olsson
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***********************************************************************/
+
+/*
+ * The control connection of the Xlib backends, backend-xlib.c and
+ * backend-xi2.c. It generates keys with XTEST and follows the keymap
+ * and the locked group with XKB, whichever way the backend takes key
+ * events in on its data connection. Backend_t holds an XlibCtrl_t that
+ * the backend hands out with xlib_ctrl ().
+ *
+ * Extensions are looked up through the XCB connection under Xlib, so
+ * the queries of both connections are sent at once, see
+ * xlib_ctrl_connect (). Xlib's XKB still asks on its own.
+ */
+
+#ifndef XLIB_CTRL_H
+#define XLIB_CTRL_H
+
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <xcb/xcb.h>
+
+#include "xcape.h"
+
+
+/************************************************************************
+ * Data types
+ ***********************************************************************/
+typedef struct _XlibCtrl_t
+{
+    Display *conn;
+    XkbDescPtr xkb;
+    int xkb_event;
+} XlibCtrl_t;
+
+/* For the data connection, see xlib_ctrl_connect () */
+extern xcb_extension_t xlib_ext_record;
+extern xcb_extension_t xlib_ext_xinput;
+
+/************************************************************************
+ * Control connection interface
+ ***********************************************************************/
+/* Defined by the backend */
+XlibCtrl_t *xlib_ctrl (Session_t *self);
+
+/*
+ * Opens both connections to the display of self, STARTUP_CONNECT, and
+ * sends the queries for XTEST and for data_ext on the data connection
+ * without waiting for the replies
+ */
+Bool xlib_ctrl_connect (Session_t *self, XlibCtrl_t *ctrl,
+        Display **data_conn, xcb_extension_t *data_ext);
+
+/* XKB and XTEST, the backend marks STARTUP_EXTENSIONS after its own */
+Bool xlib_ctrl_query (XlibCtrl_t *ctrl);
+
+/* The reply to a query sent by xlib_ctrl_connect (), False if absent */
+Bool xlib_extension (Display *dpy, xcb_extension_t *ext, int *opcode);
+
+/* Reads the keymap and locked group and selects their changes */
+Bool xlib_ctrl_keymap (Session_t *self, XlibCtrl_t *ctrl);
+
+/* Also after a failed xlib_ctrl_connect () */
+void xlib_ctrl_close (XlibCtrl_t *ctrl);
+
+#endif /* XLIB_CTRL_H */